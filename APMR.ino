@@ -6,26 +6,100 @@
  
 #include <SPI.h>
 #include <Ethernet.h>
+#include <EthernetUdp.h>
+#include <Dns.h>
+#include <utility/w5100.h>
+#include <utility/socket.h>
 #include <ModbusMaster.h>
 #include <Time.h>
 #include <Wire.h>  
 #include <DS1307RTC.h> 
 #include <SD.h>
 #include <EEPROM.h>
+#include "meter_maps.h"
+#include "log_buffer.h"
+#include "log_format.h"
+#include "print_buffer.h"
+#include "stream_copy.h"
+#include "mqtt_packet.h"
 
 // Constants Defs
 #define MAX_METERS 16
+#define MAX_BUSES 3
 #define ITYPE_INT 0
 #define ITYPE_HEX 1
 #define ITYPE_STR 2
 #define MAX_MEASURES 2
 #define MTYPE_W 0
 #define MTYPE_WH 1
+#define MAX_PLAN_REGS 32
+#define MAX_PLAN_BLOCKS 16
+#define MAX_BLOCK_FIELDS 8 // quantities decoded from one read
+#define TIMEOUT_MIN 10 // ms, floor for the adaptive per-meter timeout
+#define TIMEOUT_SLACK 8 // ms, least margin over the smoothed response time, for millis() and meter jitter
+#define BACKOFF_AFTER 3 // consecutive timeouts before a meter is backed off from
+#define BACKOFF_BASE 1000UL // ms, first retry delay for a meter that stopped answering
+#define BACKOFF_MAX 300000UL // ms, longest retry delay
+// The DS1307's SQW/OUT wired to pin 2 (external interrupt 0) gives a tick at 
+// the start of every RTC second; comment out if it is not wired
+#define RTC_SQW_PIN 2
+#define RTC_SQW_INT 0
+#define RTC_SYNC_INTERVAL 86400 // s, the ticks keep time between reads of the RTC; without them it is read every 300 s
+#define LOG_FLUSH_SECS 10 // most seconds of records held only in RAM
+#define JOURNAL_DIR "unsent"
+#define JOURNAL_PACKED_DIR "unsentb" // the journal for packed uploads
+#define JOURNAL_SEGMENT_SIZE 16384UL // bytes, a new segment is started past this
+#define UPLOAD_MAX_BYTES 32768UL // most bytes of the journal sent in one POST
+#define UPLOAD_CHUNKED_OVER 4096UL // larger uploads use chunked transfer encoding
+#define JOURNAL_LINE_MAX 256 // longest JSON line in the journal
+#define UPLOAD_TIMEOUT 10000UL // ms, longest wait for the web service's reply
+#define UPLOAD_READ_MAX 64 // reply bytes parsed per pass of loop()
+// Upload states, advanced a step per pass of loop() by upload_step()
+#define UP_IDLE 0
+#define UP_CONNECT 1 // get a connection and send the headers
+#define UP_BODY 2    // stream the batch a sector per pass
+#define UP_REPLY 3   // parse the reply as it arrives
+#define UP_CONNACK 4 // MQTT, wait for the broker to take the session
+#define UP_OPEN 5    // wait for the connection to the server, or the DNS answer first
+#define UPLINK_OPEN_TIMEOUT 5000UL // ms, longest wait for both
+// Where opening ws_client has got
+#define LINK_IDLE 0
+#define LINK_LOOKUP 1  // waiting for the DNS server's answer for ws_host
+#define LINK_OPENING 2 // the W5100 is opening the connection
+#define DNS_PORT 53
+#define DNS_LOCAL_PORT 1053
+// Where a chunked reply body is, for reply_char()
+#define CHUNK_SIZE 0    // the size line, hex
+#define CHUNK_DATA 1
+#define CHUNK_DATA_END 2 // the CRLF after the data
+#define CHUNK_TRAILER 3  // trailer lines after the last chunk, to a blank one
+// Uplink transports: an HTTP POST to ws_url, or MQTT 3.1.1 publishes
+#define UPLINK_HTTP 0
+#define UPLINK_MQTT 1
+#define MQTT_TOPIC "apmr"  // readings go to apmr/<home id>/<meter id>
+#define MQTT_KEEPALIVE 300 // s, the broker drops a session silent for 1.5 times this
+#define MQTT_PING_SECS 120 // s, of quiet before a PINGREQ
+#define MQTT_HEAD_MAX 21   // most bytes of a PUBLISH before its payload
+#define MQTT_BATCH_MAX 512 // most publishes in a batch, each one's PUBACK is a bit
+// Upload formats, see log_format.h for the packed one
+#define UPLOAD_JSON 0
+#define UPLOAD_PACKED 1
+#define PACK_TABLE_MAX (9 + 4 * MAX_METERS) // most bytes of a packed table
+#define PACK_HEAD_MAX 11    // of a packed record's tag and time
+#define PACK_METER_MAX 30   // of one meter's columns in a packed record
+#define RANGE_MAX_DAYS 31 // longest span of daily logs one /range request reads, one per pass of loop()
+#define PREALLOC_STEP 512 // bytes of tomorrow's log filled per pass of loop()
+#define PREALLOC_GUARD 50 // ms, no filling this close to a sampling slot
+#define PREALLOC_FLUSH 64 // steps between directory updates while filling
+#define SD_LATENCY_BUCKETS 8 // <4, <8, ... <256 ms, and the rest
+// the daily log is written in place, FILE_WRITE may mean always appending
+#define FILE_OVERWRITE (O_READ | O_WRITE | O_CREAT)
 
 // Default network settings
 byte mac[] = { 0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0x5A };
 
 // Default webservice settings
+byte uplink = UPLINK_HTTP;
 char ws_host[33];
 char ws_url[65];
 word ws_port = 80;
@@ -40,20 +114,229 @@ byte meter_count = 0;
 byte modbus_id[MAX_METERS];
 char meter_id[MAX_METERS][5];
 byte meter_type[MAX_METERS];
+byte meter_bus[MAX_METERS];
 float readings[MAX_METERS][MAX_MEASURES];
-char *read_rates[] = {"1 sec", "5 sec", "30 sec", "1 min", "15 min",  "30 min", "1 hr"};
-char *meter_types[] = {" ", "ION6200"/*, add other supported meter types here*/};
+boolean read_ok[MAX_METERS];      // every block of the last reading arrived
+unsigned long read_at[MAX_METERS]; // millis() of the last good reading
+// the sub-second rates were added at the end to keep the stored settings valid
+char *read_rates[] = {"1 sec", "5 sec", "30 sec", "1 min", "15 min",  "30 min", "1 hr", "100 ms", "200 ms", "500 ms"};
+unsigned long read_periods[] = {1000UL, 5000UL, 30000UL, 60000UL, 900000UL, 1800000UL, 3600000UL, 100UL, 200UL, 500UL};
+#define READ_RATE_COUNT (sizeof(read_periods) / sizeof(unsigned long))
 char *measure_types[] = {"power", "energy" };
+// how often the unsent journal goes to the web service, 0 for as soon as
+// the records are on the card
+byte upload_rate = 0;
+char *upload_rates[] = {"with every write to the card", "30 sec", "1 min", "5 min", "15 min", "1 hr"};
+unsigned long upload_periods[] = {0, 30000UL, 60000UL, 300000UL, 900000UL, 3600000UL};
+#define UPLOAD_RATE_COUNT (int)(sizeof(upload_periods) / sizeof(unsigned long))
+// what goes to the web service, JSON or packed binary; each has a journal 
+// of its own, so a change of format leaves the other's backlog for later
+byte upload_format = UPLOAD_JSON;
+const char *journal_dir = JOURNAL_DIR;
+
+// Register maps, one per supported meter model
+// NOTE: the scales will need to change depending on how your meter's CT and PT ratios are set up
+const meter_register ion6200_regs[] = 
+{
+  { MTYPE_W,  119, REG_U16, WORDS_HI_LO,  0.1 }, // kW total
+  { MTYPE_WH, 137, REG_U32, WORDS_LO_HI,  1.0 }, // kWh import
+  { MTYPE_WH, 139, REG_U32, WORDS_LO_HI, -1.0 }, // kWh export
+};
+
+meter_model meter_models[] = 
+{
+  { " ", NULL, 0 },
+  { "ION6200", ion6200_regs, sizeof(ion6200_regs) / sizeof(meter_register) },
+  // add other supported meter models here
+};
+#define MODEL_COUNT (int)(sizeof(meter_models) / sizeof(meter_model))
+
+// Coalesced reads for each meter model, built once by plan_reads()
+const meter_register *plan_regs[MAX_PLAN_REGS];
+ModbusField plan_fields[MAX_PLAN_REGS];
+read_block read_plan[MAX_PLAN_BLOCKS];
+byte plan_first[MODEL_COUNT];
+byte plan_blocks[MODEL_COUNT];
+
+// RS485/Modbus buses, bus 1 is the original shield on Serial3
+ModbusMaster buses[MAX_BUSES];
+byte bus_ports[MAX_BUSES] = { 3, 1, 2 };
 
 // Global objects, buffer and control settings
 EthernetServer server(80);
+// A /range reply being sent, see send_range_step()
+EthernetClient range_client;
+boolean range_open = false;
+unsigned long range_day, range_last;      // next daily log to send and the last, days since 1970
+unsigned long range_from_ms, range_to_ms; // into the next day and into the last
+char range_meter[5];
 time_t t;
-byte last_min = 255;
-byte last_sec = 255;
-char *sd_unsent = "t_unsent.txt";
-char *sd_json = "t_json.txt";
+word t_ms; // milliseconds into second t
+volatile byte rtc_ticks = 0;
 char sd_dir[16] = {0000000000000000};
 char sd_file[32] = {00000000000000000000000000000000};
+char ts_buf[28] = "0000-00-00 00:00:00";  // record timestamp, see format_timestamp()
+time_t ts_last = 0;
+#define NO_DAY 0xFFFFFFFFUL // no day yet; 0 is 1970-01-01, which an unset RTC reads
+unsigned long sd_day = NO_DAY; // day sd_dir and sd_file were made for, days since 1970
+
+// Write-back logging: binary records (see log_format.h) collect in log_buf
+// and go to the daily log a buffer at a time, through a file that stays open.
+// The web service still takes JSON, which goes to the unsent journal as it is made.
+LogBuffer log_buf(write_back_logs);
+File log_fp;
+File unsent_fp;              // the journal segment being appended to
+unsigned long unsent_day = NO_DAY; // day of the packed journal's last header
+char log_name[32] = "";      // daily log log_fp has open
+unsigned long log_since = 0; // millis() when the oldest record in log_buf was added
+unsigned long log_end = 0;   // bytes of the daily log written back to the card
+
+// Sparse index of the daily log for /range queries, see log_format.h
+File idx_fp;
+unsigned long log_header_at = 0; // offset of the daily log's last header
+unsigned long idx_slot;          // LOG_INDEX_SECS slot of the last index entry
+log_index idx_entry;             // waiting for its record to reach the card
+boolean idx_pending = false;
+
+// Pre-allocation: tomorrow's daily log is filled with zeros in the idle time
+// before each slot, so logging writes over clusters that are already 
+// allocated and the FAT is not touched while a reading waits. Records end 
+// where the zeros start, see find_log_end().
+boolean prealloc = false;
+File pre_fp;
+unsigned long pre_day = NO_DAY;  // day pre_fp is being filled for
+unsigned long pre_size;     // bytes it is being filled to
+word pre_steps = 0;
+
+// Daily log write latency, served at /stats/sd
+unsigned long sd_writes = 0;
+unsigned long sd_write_max = 0; // ms
+unsigned long sd_latency[SD_LATENCY_BUCKETS];
+
+// Unsent journal: numbered segment files in journal_dir, appended to and 
+// uploaded a batch at a time from the cursor ack_seg/ack_off, which is kept 
+// in cursor.dat there. Segments are removed once acknowledged in full.
+unsigned long journal_first = 1; // oldest segment on the card
+unsigned long journal_last = 1;  // segment being appended to
+unsigned long ack_seg = 1;       // the web service has everything before ack_off in ack_seg
+unsigned long ack_off = 0;
+File cursor_fp;
+boolean unsent_more = false;     // the last upload went through and left a backlog
+
+// Uplink to the web service: one HTTP/1.1 connection kept open between 
+// uploads, to an address looked up once. Counters served at /stats/uplink.
+EthernetClient ws_client;
+IPAddress ws_ip;
+boolean ws_ip_ok = false;     // ws_ip is ws_host's address
+byte ws_link = LINK_IDLE;
+word ws_port_out = 49152;     // local port of the last connection
+EthernetUDP dns_udp;          // the lookup of ws_host
+word dns_id;
+unsigned long ws_posts = 0;
+unsigned long ws_connects = 0; // new connections
+unsigned long ws_reuses = 0;   // posts on a connection left open by the last
+unsigned long ws_lookups = 0;
+unsigned long ws_failures = 0;
+unsigned long ws_last_ms = 0;  // request to reply, last post
+unsigned long ws_max_ms = 0;
+unsigned long ws_bytes = 0;    // of the bodies posted
+unsigned long ws_publishes = 0; // MQTT
+unsigned long ws_pubacks = 0;
+
+// MQTT session on ws_client, and the broker's packet coming in
+boolean mq_session = false;   // the broker took our CONNECT
+unsigned long mq_sent_at = 0; // millis() of the last packet to the broker
+byte mq_stage = 0;            // 0 type, 1 remaining length, 2 the rest
+byte mq_type;
+unsigned long mq_left;
+byte mq_shift;
+byte mq_got;
+byte mq_body[4];              // the start of the rest, enough for a PUBACK
+
+// The upload in progress
+byte up_state = UP_IDLE;
+unsigned long upload_at = 0; // millis() the last upload was started
+boolean upload_now = false;  // records reached the card, for upload_rate 0
+File up_fp;                 // journal segment being sent
+unsigned long up_seg;
+unsigned long up_end_seg;   // the batch runs from the cursor to here
+unsigned long up_end_off;
+unsigned long up_bytes;
+boolean up_full;            // the batch was cut at UPLOAD_MAX_BYTES
+boolean up_chunked;
+unsigned long up_left;      // bytes of up_seg still to send
+unsigned long up_started;   // millis() the upload started
+unsigned long up_at;        // millis() of the last progress, for timeouts
+byte up_attempt;
+boolean up_reused;          // sent on a connection left open by the last
+boolean up_keep;            // the connection can carry the next upload
+boolean up_in_headers;
+boolean up_got_any;         // any of the reply has arrived
+long up_body;               // reply Content-Length left, -1 until known
+boolean up_body_chunked;    // the reply came with Transfer-Encoding: chunked
+byte up_chunk_stage;
+long up_chunk_left;         // of the chunk, or its size as it is read
+boolean up_chunk_ext;       // in a chunk extension, skipped to the end of the line
+char up_line[48];           // reply header line being read
+byte up_line_len;
+char up_text[9];            // last 8 bytes of the reply body
+word up_sent;               // MQTT publishes, with packet IDs up_first_id on
+word up_acked;
+word up_first_id = 1;
+byte up_pubacks[MQTT_BATCH_MAX / 8]; // which publishes the broker has acknowledged
+
+// Packing the journal for an upload in the packed format
+time_t up_base;             // base_time of the batch
+log_header up_header;       // the header in force in up_seg, tag 0 if none
+log_meter up_meters[MAX_METERS];
+boolean up_table;           // up_header is still to be sent as a table
+byte up_meter;              // next meter of the record being packed
+time_t up_time;             // of the last record packed
+word up_time_ms;
+long up_cols[MAX_METERS][MAX_MEASURES]; // its values, fixed point
+
+// Sampling schedule, slots are multiples of the read period since midnight
+time_t sample_t;            // next slot
+word sample_ms;
+unsigned long sample_at;    // millis() when the next slot is due
+boolean sample_armed = false;
+unsigned long sample_count = 0;
+unsigned long sample_overruns = 0; // slots skipped because the previous reading ran over
+unsigned long sample_late_max = 0; // worst delay from slot to poll, ms
+
+// Aggregation between logged readings: the meters are read back to back and 
+// only these summaries of the power samples are logged
+boolean aggregate = false;
+boolean log_pending = false;      // a slot is waiting for its reading
+unsigned long agg_count[MAX_METERS];
+float agg_min[MAX_METERS];
+float agg_max[MAX_METERS];
+float agg_mean[MAX_METERS];       // kept running, a float sum would drop the samples' low bits
+float agg_energy[MAX_METERS];     // integrated from the power samples
+float agg_last[MAX_METERS];       // previous power sample, for integrating
+unsigned long agg_last_at[MAX_METERS]; // and when it was read, 0 if none
+unsigned long log_count[MAX_METERS]; // the summaries of the interval just logged
+float log_min[MAX_METERS];
+float log_max[MAX_METERS];
+float log_energy[MAX_METERS];
+
+// Meter polling state for each bus, advanced a step at a time from loop()
+boolean polling = false;
+byte poll_meter[MAX_BUSES];
+byte poll_block[MAX_BUSES];
+boolean poll_started[MAX_BUSES];
+reg_value poll_values[MAX_BUSES][MAX_BLOCK_FIELDS];
+
+// Per meter response times and failures, for adaptive timeouts and backing
+// off from meters that do not answer
+// The estimates leave out the time the reply takes on the wire, which depends
+// on the block read, and are kept scaled as in RFC 6298 so the smoothing does
+// not truncate them towards 0
+word mb_srtt[MAX_METERS];  // smoothed response time, 1/8 ms
+word mb_rttvar[MAX_METERS]; // response time variation, 1/4 ms
+byte mb_timeouts[MAX_METERS]; // consecutive timeouts
+unsigned long mb_retry_at[MAX_METERS];
+ModbusStats mb_stats[MAX_METERS]; // served at /stats/modbus
 
 void setup() 
 {
@@ -64,6 +347,8 @@ void setup()
   Serial.begin(baud_rates[console_baud_rate]);
   delay(1000);
   
+  plan_reads();
+  
   Serial.print("Booting");
   // Initialize SD Card
   // On the Ethernet Shield, CS is pin 4. It's set as an output by default.
@@ -83,10 +368,38 @@ void setup()
 
   // Setup the RTC interface 
   setSyncProvider(RTC.get);
+#ifdef RTC_SQW_PIN
+  // count seconds off the RTC rather than millis(), if its 1 Hz output ticks
+  RTC.squareWave(DS1307_SQW_1HZ);
+  pinMode(RTC_SQW_PIN, INPUT_PULLUP);
+  attachInterrupt(RTC_SQW_INT, rtc_tick, FALLING);
+  
+  unsigned long wait = millis();
+  while(rtc_ticks < 2 && millis() - wait < 2100);
+  if(rtc_ticks >= 2)
+  {
+    setSecondTicks(true, RTC_SYNC_INTERVAL);
+  }
+  else
+  {
+    detachInterrupt(RTC_SQW_INT);
+    Serial.println("\r\nERROR: (S3) no 1 Hz tick from the RTC SQW/OUT pin, timing off millis()");
+  }
+#endif
   Serial.print(".");
   
-  // Setup connection to RS485/MODBUS
-  Modbus.begin(3, baud_rates[rs485_baud_rate]);
+  // Setup connection to RS485/MODBUS, only on the buses that have meters
+  for(int b = 0; b < MAX_BUSES; b++)
+  {
+    for(int i = 0; i < meter_count; i++)
+    {
+      if(meter_bus[i] == b)
+      {
+        buses[b].begin(bus_ports[b], baud_rates[rs485_baud_rate]);
+        break;
+      }
+    }
+  }
   Serial.print(".");
   
   // Setup the ehternet connection, and wait a bit  
@@ -102,355 +415,2338 @@ void setup()
 
   // Startup the Arduino web server
   server.begin();
+  
+  // upload envelope file from older versions
+  SD.remove("t_json.txt");
+  open_journal();
+  
+  schedule_sample();
 }
 
 void loop() 
 {
-  boolean do_read = false;
+  if((long)(millis() - sample_at) >= 0)
+  {
+    if(log_pending)
+    {
+      // still reading the last slot, this one is lost
+      sample_overruns++;
+      Serial.println("ERROR: (R1) meter reading overran its slot");
+    }
+    else
+    {
+      // update time structures and variables for this reading
+      t = sample_t;
+      t_ms = sample_ms;
+      if(elapsedDays(t) != sd_day)
+      {
+        sd_day = elapsedDays(t);
+        sprintf(sd_dir, "%04d/%02d", year(t), month(t));
+        sprintf(sd_file, "%s/%02d.bin", sd_dir, day(t));
+      }
 
-  // update time structures and variables
-  t = now();
-  sprintf(sd_dir, "%04d/%02d", year(t), month(t));
-  sprintf(sd_file, "%s/%02d.txt", sd_dir, day(t));
+      log_pending = true;
+      sample_count++;
+      sample_late_max = max(sample_late_max, millis() - sample_at);
+    }
     
-  switch(read_rate)
+    schedule_sample();
+  }
+  
+  // when aggregating a new round starts as soon as the last one is done,
+  // otherwise only for a slot
+  if(!polling && (log_pending || aggregate))
+    start_read_meters();
+  
+  // the Modbus replies trickle in over several passes of loop()
+  if(polling && read_meters())
   {
-    case 0: // 1 reading / 1 second
-      do_read = (second(t) != last_sec);
-      break;
-    case 1: // 1 reading / 5 seconds
-      do_read = (second(t) != last_sec && !(second(t) % 5));
-      break;
-      
-    case 2: // 1 reading / 30 seconds
-      do_read = (second(t) != last_sec && !(second(t) % 30));
-      break;  
-      
-    case 3: // 1 reading / 1 minute
-      do_read = (!second(t) && minute(t) != last_min);
-      break;
-      
-    case 4: // 1 reading / 15 minutes
-      do_read = (!second(t) && minute(t) != last_min && !(minute(t) % 15));
-      break;
-      
-    case 5: // 1 reading / 30 minutes
-      do_read = (!second(t) && minute(t) != last_min && !(minute(t) % 30));
-      break;
+    polling = false;
+    
+    if(aggregate)
+      aggregate_readings();
       
-    case 6: // 1 reading / 1 hour
-      do_read = (!second(t) && minute(t) != last_min && !minute(t));
-      break;
+    if(log_pending)
+    {
+      log_pending = false;
+      if(aggregate)
+        close_aggregates();
+      write_date();
+    }
   }
   
-  if(do_read)
+  // the records reach the card a buffer at a time, and the web service 
+  // at its own pace
+  if(logs_due())
   {
-    if(read_meters() && write_date() && send_data()); 
-
-    last_min = second(t);
-    last_sec = minute(t);
+    flush_logs();
+    upload_now = true;
   }
+  if(up_state == UP_IDLE && upload_due())
+    start_upload();
+  
+  // an upload only ever holds loop() up for a step, a slow web service
+  // does not stop sampling or the local web server
+  if(up_state != UP_IDLE)
+    upload_step();
+  else if(uplink == UPLINK_MQTT)
+    mqtt_idle();
 
   // Did anyone make a web request? 
   handle_web_requests();
+  
+  if(prealloc && !log_pending && (long)(sample_at - millis()) > PREALLOC_GUARD)
+    prealloc_step();
+}
+
+// Set sample_at to the next slot after the current time. Slots are locked to 
+// the RTC's seconds (through now()) rather than counted off millis(), so they 
+// do not drift. Slots that went by while loop() was busy count as overruns.
+void schedule_sample()
+{
+  unsigned int ms;
+  time_t t_now = now(ms);
+  unsigned long period = read_periods[read_rate];
+  unsigned long slot = ((elapsedSecsToday(t_now) * 1000UL + ms) / period + 1) * period;
+  time_t next_t = previousMidnight(t_now) + slot / 1000;
+  word next_ms = slot % 1000;
+  
+  if(sample_armed)
+  {
+    long gap = (long)(next_t - sample_t) * 1000L + next_ms - sample_ms;
+    
+    if(gap <= 0)
+    {
+      // the clock was set back, never take a slot twice
+      next_t = sample_t + (period + sample_ms) / 1000;
+      next_ms = (period + sample_ms) % 1000;
+    }
+    else
+    {
+      sample_overruns += gap / period - 1;
+    }
+  }
+  
+  sample_at = millis() + (long)(next_t - t_now) * 1000L + next_ms - ms;
+  sample_t = next_t;
+  sample_ms = next_ms;
+  sample_armed = true;
+}
+
+// Add the power readings of the round just finished to the running summaries
+void aggregate_readings()
+{
+  for(int i = 0; i < meter_count; i++)
+  {
+    if(!read_ok[i])
+    {
+      // do not integrate across a gap
+      agg_last_at[i] = 0;
+      continue;
+    }
+    
+    float w = readings[i][MTYPE_W];
+    
+    if(!agg_count[i] || w < agg_min[i])
+      agg_min[i] = w;
+    if(!agg_count[i] || w > agg_max[i])
+      agg_max[i] = w;
+    agg_count[i]++;
+    agg_mean[i] += (w - agg_mean[i]) / agg_count[i];
+    
+    // trapezoid rule, power units times hours
+    if(agg_last_at[i])
+      agg_energy[i] += (agg_last[i] + w) / 2 * (read_at[i] - agg_last_at[i]) / 3600000.0;
+    agg_last[i] = w;
+    agg_last_at[i] = read_at[i];
+  }
+}
+
+// End the interval for logging: readings[] gets the mean power and the last
+// energy register value, log_...[] the rest of the summaries
+void close_aggregates()
+{
+  for(int i = 0; i < meter_count; i++)
+  {
+    log_count[i] = agg_count[i];
+    log_min[i] = agg_count[i] ? agg_min[i] : 0;
+    log_max[i] = agg_count[i] ? agg_max[i] : 0;
+    log_energy[i] = agg_energy[i];
+    readings[i][MTYPE_W] = agg_mean[i];
+    
+    agg_count[i] = 0;
+    agg_mean[i] = 0;
+    agg_energy[i] = 0;
+  }
+}
+
+// RTC SQW/OUT falling edge, the start of a second
+void rtc_tick()
+{
+  secondTick();
+  if(rtc_ticks < 255)
+    rtc_ticks++;
 }
 
+void start_read_meters()
+{
+  polling = true;
+  for(int b = 0; b < MAX_BUSES; b++)
+  {
+    poll_meter[b] = 0;
+    poll_block[b] = 0;
+    poll_started[b] = false;
+  }
+}
+
+// Advance the meter readings on every bus without waiting on them, returns 
+// true once every meter has been read (or has failed to answer)
 boolean read_meters()
 {
+  boolean done = true;
+  
+  // the buses are independent, so their transactions overlap
+  for(int b = 0; b < MAX_BUSES; b++)
+  {
+    if(!read_bus(b))
+      done = false;
+  }
+  
+  return done;
+}
+
+// Advance the readings of the meters on one bus, returns true once they are 
+// all done
+boolean read_bus(byte b)
+{
+  ModbusMaster &bus = buses[b];
   int result;
     
-  for(int i = 0; i < meter_count; i++)
+  while(poll_meter[b] < meter_count)
   {
-    for(int j; j < MAX_MEASURES; j++)
-      readings[i][j] = 0;
+    int i = poll_meter[b];
+    byte model = (meter_type[i] < MODEL_COUNT) ? meter_type[i] : 0;
+
+    if(meter_bus[i] != b || poll_block[b] >= plan_blocks[model])
+    {
+      poll_block[b] = 0;
+      poll_meter[b]++;
+      continue;
+    }
+
+    read_block *block = &read_plan[plan_first[model] + poll_block[b]];
+
+    if(!poll_started[b])
+    {
+      if(!poll_block[b])
+      {
+        read_ok[i] = false;
+        for(int j = 0; j < MAX_MEASURES; j++)
+          readings[i][j] = 0;
+        
+        // a meter that stopped answering is only retried now and then
+        if(mb_timeouts[i] >= BACKOFF_AFTER && (long)(millis() - mb_retry_at[i]) < 0)
+        {
+          poll_block[b] = plan_blocks[model];
+          continue;
+        }
+      }
     
-    if(meter_type[i] == 1)
+      bus.setResponseTimeout(meter_timeout(i, block->count));
+      bus.setStats(&mb_stats[i]);
+      // the library holds off until the bus has been quiet for 3.5 chars
+      // the values are decoded straight from the reply into poll_values
+      if(bus.startReadHoldingRegisters(modbus_id[i], block->address, block->count, 
+                                       &plan_fields[block->first_reg], block->reg_count, poll_values[b]) != bus.MBSuccess)
+        return false;
+      poll_started[b] = true;
+    }
+
+    result = bus.poll();
+    if(result == bus.MBBusy)
+      return false;
+
+    poll_started[b] = false;
+    track_meter_response(i, result, bus.lastLatency(), block->count);
+
+    if(result == bus.MBSuccess)
     {
-      result = Modbus.readHoldingRegisters(modbus_id[i], 119, 28);
-      if(result == (int)Modbus.MBSuccess)
+      for(int r = 0; r < block->reg_count; r++)
       {
-        // NOTE: the 0.001 will need to change depending on how your meter's CT and PT ratios are set up
-        readings[i][MTYPE_W] = (float)Modbus.getResponseBuffer(0) * 0.1; //* 0.0001;
-        readings[i][MTYPE_WH] = (float)LONG((long)Modbus.getResponseBuffer(19), (long)Modbus.getResponseBuffer(18))  - //* 0.001 -
-                         (float)LONG((long)Modbus.getResponseBuffer(21), (long)Modbus.getResponseBuffer(20)); // * 0.001;
+        const meter_register *reg = plan_regs[block->first_reg + r];
+        readings[i][reg->measure] += register_value(reg, &poll_values[b][r]) * reg->scale;
+      }
+      poll_block[b]++;
+      
+      if(poll_block[b] == plan_blocks[model])
+      {
+        read_ok[i] = true;
+        read_at[i] = millis();
       }
     }
-    //else if(!strcmp(meter_type[i], "???????"))
-    // ... add other meter models here....
-  
-    delay(10);
+    else
+    {
+      // a partial reading is worse than none, skip the rest of this meter
+      for(int j = 0; j < MAX_MEASURES; j++)
+        readings[i][j] = 0;
+      poll_block[b] = plan_blocks[model];
+    }
   }
   
   return true;
 }
 
-boolean write_date()
+// Time a reply to a read of count registers takes on the RS485 line, ms:
+// slave ID, function, byte count, the registers and the CRC, 11 bits a byte
+word reply_ms(word count)
 {
-  if(!SD.mkdir(sd_dir))
-  {
-    Serial.print("ERROR: (D3) unable to create SD card dir: ");
-    Serial.println(sd_dir);
-    return false;
-  }
-
-  // write data to log and temp unsent log
-  if(!write_log(sd_file, 11))
-    return false;
-  if(!write_log(sd_unsent, 12))
-    return false;
+  long baud = baud_rates[rs485_baud_rate];
+  
+  return ((5 + 2UL * count) * 11000UL + baud - 1) / baud;
+}
 
-  // write out the json code we want to sent over http
-  if(!write_json(sd_unsent, sd_json, 13))
-    return false;
+// How long to wait for a meter's reply to a read of count registers, from
+// its observed response times
+word meter_timeout(int i, word count)
+{
+  unsigned long timeout;
   
-  return true;
+  // until a meter has answered, wait the library's worst case
+  if(!mb_srtt[i])
+    return ModbusMaster::MBResponseTimeout;
+  
+  // RFC 6298's SRTT + max(G, 4 * RTTVAR), mb_rttvar being 4 * RTTVAR already
+  timeout = mb_srtt[i] / 8 + max(mb_rttvar[i], TIMEOUT_SLACK) + reply_ms(count);
+  
+  // and doubled for each timeout in a row, as a retransmit timer backs off
+  timeout <<= min(mb_timeouts[i], BACKOFF_AFTER);
+  
+  return constrain(timeout, TIMEOUT_MIN, ModbusMaster::MBResponseTimeout);
 }
 
-void print_it(Print &printer)
+// Update a meter's response time estimate and its backoff after a read of
+// count registers that took rtt ms
+void track_meter_response(int i, int result, word rtt, word count)
 {
-  for(int i = 0; i < meter_count; i++)  
+  if(result == ModbusMaster::MBSuccess)
   {
-    printer.print("{\"meter\": \"");
-    printer.print(meter_id[i]);
-    printer.print("\", \"ts\": \"");
-    printer.print(year(t));
-    printer.print("-");
+    // the meter's own part of it, which is the same for every block
+    int r = (rtt > reply_ms(count)) ? rtt - reply_ms(count) : 0;
     
-    if(month(t) < 10) printer.print('0');
-    printer.print(month(t));
+    // same smoothing as TCP's retransmit timer (RFC 6298), in its scaled form
+    if(!mb_srtt[i])
+    {
+      mb_srtt[i] = max(8 * r, 1);
+      mb_rttvar[i] = 2 * r;
+    }
+    else
+    {
+      mb_rttvar[i] = (3 * mb_rttvar[i] + abs(8 * r - (int)mb_srtt[i]) / 2) / 4;
+      mb_srtt[i] = max((7 * mb_srtt[i] + 8 * r) / 8, 1);
+    }
+    mb_timeouts[i] = 0;
+  }
+  else if(result == ModbusMaster::MBResponseTimedOut)
+  {
+    if(mb_timeouts[i] < 255)
+      mb_timeouts[i]++;
     
-    printer.print("-");
+    // a timeout now and then is only jitter, the timer backs off and the
+    // meter is read again next time; only a meter that keeps on timing out
+    // is retried less and less often, with the full timeout since the old
+    // estimate evidently no longer holds
+    if(mb_timeouts[i] >= BACKOFF_AFTER)
+    {
+      unsigned long backoff = BACKOFF_BASE << min(mb_timeouts[i] - BACKOFF_AFTER, 9);
+      
+      mb_srtt[i] = 0;
+      mb_retry_at[i] = millis() + min(backoff, BACKOFF_MAX);
+    }
+  }
+}
 
-    if(day(t) < 10) printer.print('0');
-    printer.print(day(t));
+// Value of one register map entry as decoded by ModbusMaster
+float register_value(const meter_register *reg, const reg_value *v)
+{
+  switch(reg->type)
+  {
+    case REG_U16: return (float)v->u16;
+    case REG_S16: return (float)v->s16;
+    case REG_S32: return (float)v->s32;
+    case REG_F32: return v->f32;
+  }
+  return (float)v->u32;
+}
 
-    printer.print(" ");
+// Width of a register map entry in 16 bit registers
+byte register_width(const meter_register *reg)
+{
+  return (reg->type == REG_U16 || reg->type == REG_S16) ? 1 : 2;
+}
 
-    if(hour(t) < 10) printer.print('0');
-    printer.print(hour(t));
+// Turn each meter model's register map into as few Modbus reads as possible:
+// sort the registers by address and read through gaps shorter than a read of
+// their own would take at the bus speed, see plan_joins(). A model whose
+// registers do not all fit in MAX_PLAN_REGS and MAX_PLAN_BLOCKS is reported,
+// only those that fit are read.
+void plan_reads()
+{
+  byte nregs = 0;
+  byte nblocks = 0;
+  
+  for(int m = 0; m < MODEL_COUNT; m++)
+  {
+    byte first = nregs;
+    boolean fits = true;
+    
+    plan_first[m] = nblocks;
+    plan_blocks[m] = 0;
 
-    printer.print(":");
+    for(int r = 0; r < meter_models[m].reg_count; r++)
+    {
+      if(nregs == MAX_PLAN_REGS)
+      {
+        fits = false;
+        break;
+      }
+      
+      // insertion sort by address
+      const meter_register *reg = &meter_models[m].regs[r];
+      int k = nregs++;
+      for(; k > first && plan_regs[k - 1]->address > reg->address; k--)
+        plan_regs[k] = plan_regs[k - 1];
+      plan_regs[k] = reg;
+    }
+    
+    for(int r = first; r < nregs; r++)
+    {
+      const meter_register *reg = plan_regs[r];
+      word end = reg->address + register_width(reg);
+      read_block *block = plan_blocks[m] ? &read_plan[nblocks - 1] : NULL;
+      
+      if(block && plan_joins(block, reg->address, end, baud_rates[rs485_baud_rate]) && 
+         block->reg_count < MAX_BLOCK_FIELDS)
+      {
+        if(end > block->address + block->count)
+          block->count = end - block->address;
+        block->reg_count++;
+      }
+      else if(nblocks < MAX_PLAN_BLOCKS)
+      {
+        block = &read_plan[nblocks++];
+        block->address = reg->address;
+        block->count = end - reg->address;
+        block->first_reg = r;
+        block->reg_count = 1;
+        plan_blocks[m]++;
+      }
+      else
+      {
+        fits = false;
+        break;
+      }
+      
+      // where ModbusMaster decodes this register to, see poll_values
+      plan_fields[r].Register = reg->address - block->address;
+      plan_fields[r].Type = reg->type | reg->order;
+      plan_fields[r].Offset = (r - block->first_reg) * sizeof(reg_value);
+    }
+    
+    if(!fits)
+    {
+      Serial.print("ERROR: (M1) register map too big, not all of it will be read: ");
+      Serial.println(meter_models[m].name);
+    }
+  }
+}
 
-    if(minute(t) < 10) printer.print('0');
-    printer.print(minute(t));
+// Add this reading's records to the log buffer and the unsent log
+boolean write_date()
+{
+  // a new day, the records so far belong in the old day's file
+  if(strcmp(log_name, sd_file))
+  {
+    flush_logs();
+    log_fp.close();
+    idx_fp.close();
+    log_name[0] = 0;
+    
+    // tomorrow came before its file was filled, the rest grows as it goes
+    if(pre_day == sd_day)
+      pre_fp.close();
+    
+    if(!SD.mkdir(sd_dir))
+    {
+      Serial.print("ERROR: (D3) unable to create SD card dir: ");
+      Serial.println(sd_dir);
+      return false;
+    }
+    
+    if(!(log_fp = SD.open(sd_file, FILE_OVERWRITE)))
+    {
+      Serial.print("ERROR: (11) unable to open SD card file: ");
+      Serial.println(sd_file);
+      return false;
+    }
+    strcpy(log_name, sd_file);
+    
+    char idx_name[32];
+    index_name(idx_name, sd_file);
+    if(!(idx_fp = SD.open(idx_name, FILE_WRITE)))
+    {
+      Serial.print("ERROR: (11) unable to open SD card file: ");
+      Serial.println(idx_name);
+    }
+    
+    log_end = find_log_end(log_fp, sd_file);
+    log_fp.seek(log_end);
+    log_header_at = log_end;
+    log_since = millis(); // flush_logs() emptied log_buf
+    write_log_header(log_buf);
+    idx_slot = 0xFFFFFFFFUL; // index the first record after the header
+  }
 
-    printer.print(":");
+  if(!log_buf.length())
+    log_since = millis();
+  if(elapsedSecsToday(t) / LOG_INDEX_SECS != idx_slot)
+  {
+    idx_slot = elapsedSecsToday(t) / LOG_INDEX_SECS;
+    idx_entry.ms = elapsedSecsToday(t) * 1000UL + t_ms;
+    idx_entry.record = log_end + log_buf.length();
+    idx_entry.header = log_header_at;
+    idx_pending = true;
+  }
+  write_log_record(log_buf);
+  
+  char name[24];
+  
+  journal_name(name, journal_last);
+  if(!unsent_fp)
+  {
+    unsent_fp = SD.open(name, FILE_WRITE);
+    unsent_day = NO_DAY;
+  }
+  if(unsent_fp && upload_format == UPLOAD_PACKED)
+  {
+    // record times count from midnight, so each day needs its header
+    if(unsent_day != sd_day)
+      write_log_header(unsent_fp);
+    unsent_day = sd_day;
+    write_log_record(unsent_fp);
+  }
+  else if(unsent_fp)
+    print_it(unsent_fp);
+  if(!unsent_fp || unsent_fp.getWriteError())
+  {
+    Serial.print("ERROR: (12) unable to write SD card file: ");
+    Serial.println(name);
+    unsent_fp.clearWriteError();
+    
+    // what follows a torn block could not be found, start a new segment
+    if(unsent_fp && upload_format == UPLOAD_PACKED)
+    {
+      unsent_fp.close();
+      journal_last++;
+    }
+  }
+  
+  // records never straddle two segments, so a segment is only ever cut 
+  // between lines
+  if(unsent_fp && unsent_fp.size() >= JOURNAL_SEGMENT_SIZE)
+  {
+    unsent_fp.close();
+    journal_last++;
+  }
+  
+  return true;
+}
 
-    if(second(t) < 10) printer.print('0');
-    printer.print(second(t));
+// The header of a daily log, the meter table the records that follow use
+void write_log_header(Print &out)
+{
+  log_header h;
+  
+  h.tag = LOG_TAG_HEADER;
+  memcpy(h.magic, LOG_MAGIC, sizeof(h.magic));
+  h.version = LOG_VERSION;
+  h.flags = aggregate ? LOG_FLAG_AGGREGATE : 0;
+  h.meter_count = meter_count;
+  h.measure_count = MAX_MEASURES;
+  memcpy(h.home_id, home_id, sizeof(h.home_id));
+  h.base_time = previousMidnight(t);
+  h.period_ms = read_periods[read_rate];
+  out.write((const uint8_t *)&h, sizeof(h));
+  
+  for(int i = 0; i < meter_count; i++)
+  {
+    log_meter m;
+    
+    memcpy(m.id, meter_id[i], sizeof(m.id));
+    m.modbus_id = modbus_id[i];
+    m.bus = meter_bus[i];
+    m.type = meter_type[i];
+    out.write((const uint8_t *)&m, sizeof(m));
+  }
+}
 
-    printer.print(" UTC\", ");
+// One binary record of this reading, every meter's values in table order
+void write_log_record(Print &out)
+{
+  log_record r;
+  
+  r.tag = LOG_TAG_RECORD;
+  r.ms = elapsedSecsToday(t) * 1000UL + t_ms;
+  out.write((const uint8_t *)&r, sizeof(r));
+  
+  for(int i = 0; i < meter_count; i++)
+  {
+    out.write((const uint8_t *)readings[i], sizeof(readings[i]));
     
-    for(int j = 0; j < MAX_MEASURES; j++)
+    if(aggregate)
     {
-      printer.print("\"");
-      printer.print(measure_types[j]);
-      printer.print("\": "); 
-      printer.print(readings[i][j]);
-      printer.print(", ");
+      log_aggregate a;
+      
+      a.power_min = log_min[i];
+      a.power_max = log_max[i];
+      a.energy_int = log_energy[i];
+      a.samples = log_count[i];
+      out.write((const uint8_t *)&a, sizeof(a));
     }
-    printer.print("},\r\n");
   }
+  out.write(LOG_RECORD_END);
 }
 
-boolean write_log(char *fname, byte errno)
+// Time to get the buffered records onto the card: they have waited long 
+// enough, or the next reading is further off than that anyway
+boolean logs_due()
 {
-  File fp;
+  return log_buf.length() && 
+         (millis() - log_since >= LOG_FLUSH_SECS * 1000UL || read_periods[read_rate] >= LOG_FLUSH_SECS * 1000UL);
+}
+
+// Sink for log_buf, adds to the daily log
+void write_back_logs(const uint8_t *data, word len)
+{
+  unsigned long started = millis();
   
-  if(!(fp = SD.open(fname, FILE_WRITE)))
+  if(!log_fp || log_fp.write(data, len) != len)
   {
-    Serial.print("ERROR: (");
-    Serial.print(errno);
-    Serial.print(") unable to open SD card file: ");
-    Serial.println(fname);
-    return false;
+    Serial.print("ERROR: (11) unable to write SD card file: ");
+    Serial.println(log_name);
+    return;
   }
+  log_end += len;
+  track_sd_write(millis() - started);
+}
 
-  print_it(fp);
-
-  fp.close();
-  return true;
+// Write out log_buf and commit the logs' sizes to the directory. The index
+// entry goes last, so it never points past what is on the card.
+void flush_logs()
+{
+  log_buf.write_back();
+  if(log_fp)
+  {
+    unsigned long started = millis();
+    
+    log_fp.flush();
+    track_sd_write(millis() - started);
+  }
+  if(unsent_fp)
+    unsent_fp.flush();
+  
+  if(idx_pending && idx_fp)
+  {
+    idx_fp.write((const uint8_t *)&idx_entry, sizeof(idx_entry));
+    idx_fp.flush();
+  }
+  idx_pending = false;
 }
 
-boolean write_json(char *source_file, char *target_file, byte errno)
+// Add one daily log write to the latency statistics
+void track_sd_write(unsigned long ms)
 {
-  File sfp;
-  File tfp;
+  byte b = 0;
+  
+  while(b < SD_LATENCY_BUCKETS - 1 && ms >= (4UL << b))
+    b++;
+  sd_latency[b]++;
+  sd_writes++;
+  sd_write_max = max(sd_write_max, ms);
+}
 
-  SD.remove(target_file);
+// Where the records in a daily log end: the file size, or in a pre-allocated
+// file the start of the zeros. The records are walked from the last index
+// entry; one cut short or torn by a reset is dropped, so the next lines up.
+unsigned long find_log_end(File &fp, char *name)
+{
+  log_header h;
+  log_meter meters[MAX_METERS];
+  log_index entry;
+  boolean have_header = false;
+  unsigned long pos = 0;
+  unsigned long last_ms = 0;
+  unsigned long size = fp.size();
+  char idx_name[32];
+  File idx;
+  
+  index_name(idx_name, name);
+  if((idx = SD.open(idx_name, FILE_READ)) && idx.size() >= sizeof(entry))
+  {
+    idx.seek((idx.size() / sizeof(entry) - 1) * sizeof(entry));
+    if(idx.read(&entry, sizeof(entry)) == sizeof(entry) && entry.record < size)
+    {
+      fp.seek(entry.header);
+      if(fp.read() == LOG_TAG_HEADER && read_log_header(fp, h, meters))
+      {
+        have_header = true;
+        pos = entry.record;
+        last_ms = entry.ms;
+      }
+    }
+  }
+  idx.close();
   
-  if(!(tfp = SD.open(target_file, FILE_WRITE)))
+  while(pos < size)
+  {
+    int tag;
+    
+    fp.seek(pos);
+    tag = fp.read();
+    if(tag == LOG_TAG_HEADER)
+    {
+      if(!(have_header = read_log_header(fp, h, meters)))
+        break;
+      pos = fp.position();
+      last_ms = 0;
+    }
+    else if(tag == LOG_TAG_RECORD && have_header)
+    {
+      unsigned long next = pos + log_record_size(h);
+      log_record r;
+      
+      if(next > size || fp.read((uint8_t *)&r + 1, sizeof(r) - 1) != sizeof(r) - 1 ||
+         r.ms < last_ms || r.ms >= SECS_PER_DAY * 1000UL || !log_record_whole(fp, pos, h))
+        break;
+      last_ms = r.ms;
+      pos = next;
+    }
+    else
+      break;
+  }
+  
+  return pos;
+}
+
+// Whether the record at pos under header h was written whole: a reset part
+// way through leaves its last byte something other than LOG_RECORD_END
+boolean log_record_whole(File &fp, unsigned long pos, const log_header &h)
+{
+  unsigned long at = fp.position();
+  boolean whole;
+  
+  fp.seek(pos + log_record_size(h) - 1);
+  whole = fp.read() == LOG_RECORD_END;
+  fp.seek(at);
+  return whole;
+}
+
+// Bytes a day of logging takes at the current settings, with room for a few
+// headers after resets
+unsigned long log_day_size()
+{
+  unsigned long record = sizeof(log_record) + meter_count * (MAX_MEASURES * sizeof(float) + (aggregate ? sizeof(log_aggregate) : 0)) + 1;
+  unsigned long header = sizeof(log_header) + meter_count * sizeof(log_meter);
+  
+  return 86400000UL / read_periods[read_rate] * record + 4 * header;
+}
+
+// Fill tomorrow's daily log with another PREALLOC_STEP bytes of zeros
+void prealloc_step()
+{
+  static uint8_t zeros[32];
+  unsigned long tomorrow = elapsedDays(now()) + 1;
+  
+  if(pre_day != tomorrow)
+  {
+    time_t midnight = tomorrow * SECS_PER_DAY;
+    char dir[16];
+    char name[32];
+    
+    pre_fp.close();
+    pre_day = tomorrow;
+    pre_size = log_day_size();
+    pre_steps = 0;
+    
+    // a file already there was started on an earlier boot, carry on with it
+    sprintf(dir, "%04d/%02d", year(midnight), month(midnight));
+    sprintf(name, "%s/%02d.bin", dir, day(midnight));
+    SD.mkdir(dir);
+    if(!(pre_fp = SD.open(name, FILE_WRITE)))
+    {
+      Serial.print("ERROR: (11) unable to open SD card file: ");
+      Serial.println(name);
+    }
+  }
+  
+  if(!pre_fp)
+    return;
+  if(pre_fp.size() >= pre_size)
+  {
+    pre_fp.close();
+    return;
+  }
+  
+  for(int i = 0; i < PREALLOC_STEP; i += sizeof(zeros))
+    pre_fp.write(zeros, sizeof(zeros));
+  
+  // the size in the directory keeps the clusters if the board resets
+  if(++pre_steps % PREALLOC_FLUSH == 0)
+    pre_fp.flush();
+}
+
+// Path of the index of a daily log: DD.idx for DD.bin
+void index_name(char *name, const char *log)
+{
+  strcpy(name, log);
+  strcpy(strrchr(name, '.'), ".idx");
+}
+
+// Path of unsent journal segment n
+void journal_name(char *name, unsigned long n)
+{
+  sprintf(name, "%s/%08lu.%s", journal_dir, n, upload_format == UPLOAD_PACKED ? "bin" : "txt");
+}
+
+// Find the journal's segments and the upload cursor after a reset
+void open_journal()
+{
+  unsigned long cursor[3]; // ack_seg, ack_off and a check of the two
+  char name[24];
+  
+  journal_dir = (upload_format == UPLOAD_PACKED) ? JOURNAL_PACKED_DIR : JOURNAL_DIR;
+  if(!SD.exists(journal_dir))
+    SD.mkdir(journal_dir);
+  
+  File dir = SD.open(journal_dir);
+  boolean found = false;
+  
+  while(true)
+  {
+    File entry = dir.openNextFile();
+    
+    if(!entry)
+      break;
+    if(isdigit(entry.name()[0]))
+    {
+      unsigned long n = atol(entry.name());
+      
+      if(!found || n < journal_first)
+        journal_first = n;
+      if(!found || n > journal_last)
+        journal_last = n;
+      found = true;
+    }
+    entry.close();
+  }
+  dir.close();
+  
+  // the cursor is rewritten in place, a torn write fails the check and the
+  // oldest segment is sent again from the start. FILE_WRITE would append
+  // every save and leave the first one at offset 0.
+  sprintf(name, "%s/cursor.dat", journal_dir);
+  cursor_fp = SD.open(name, FILE_OVERWRITE);
+  cursor_fp.seek(0);
+  if(cursor_fp.read(cursor, sizeof(cursor)) == sizeof(cursor) && (cursor[0] ^ cursor[1] ^ cursor[2]) == 0xA5A5A5A5UL)
+  {
+    ack_seg = cursor[0];
+    ack_off = cursor[1];
+  }
+  else
+  {
+    ack_seg = journal_first;
+    ack_off = 0;
+  }
+  
+  // segments acknowledged just before a reset may not have been removed
+  for(; found && journal_first < ack_seg && journal_first <= journal_last; journal_first++)
+  {
+    journal_name(name, journal_first);
+    SD.remove(name);
+  }
+  
+  if(!found || journal_first > journal_last)
+    journal_first = journal_last = max(ack_seg, 1UL);
+  if(ack_seg < journal_first)
+  {
+    ack_seg = journal_first;
+    ack_off = 0;
+  }
+  
+  // a packed block torn by the reset would hide whatever was added after
+  // it, so appending starts on a new segment
+  journal_name(name, journal_last);
+  if(upload_format == UPLOAD_PACKED && SD.exists(name))
+    journal_last++;
+  
+  unsent_more = found;
+}
+
+// Record how far the web service has acknowledged the journal
+void save_cursor()
+{
+  unsigned long cursor[3] = { ack_seg, ack_off, ack_seg ^ ack_off ^ 0xA5A5A5A5UL };
+  
+  cursor_fp.seek(0);
+  if(cursor_fp.write((const uint8_t *)cursor, sizeof(cursor)) != sizeof(cursor))
+  {
+    Serial.print("ERROR: (12) unable to write SD card file: ");
+    Serial.print(journal_dir);
+    Serial.println("/cursor.dat");
+  }
+  cursor_fp.flush();
+}
+
+// Move the cursor to off in segment seg and remove the segments before it.
+// The cursor is saved first, so a reset in between leaves at worst segments
+// open_journal() removes. The segment still being appended to is never
+// removed, whatever was measured of it, as it may have grown since.
+void ack_journal(unsigned long seg, unsigned long off)
+{
+  char name[24];
+  
+  ack_seg = seg;
+  ack_off = off;
+  save_cursor();
+  
+  for(; journal_first < ack_seg && journal_first < journal_last; journal_first++)
+  {
+    journal_name(name, journal_first);
+    SD.remove(name);
+  }
+}
+
+// Where a batch from offset start in a segment ends: at most max bytes on, 
+// after the last whole line
+unsigned long batch_end(File &fp, unsigned long start, unsigned long max)
+{
+  unsigned long end = fp.size();
+  char buf[JOURNAL_LINE_MAX];
+  int n;
+  
+  if(end - start <= max)
+    return end;
+  if(max < sizeof(buf))
+    return start; // no room for another line
+  
+  end = start + max;
+  fp.seek(end - sizeof(buf));
+  n = fp.read(buf, sizeof(buf));
+  while(n > 0 && buf[n - 1] != '\n')
+    n--;
+  
+  return n > 0 ? end - sizeof(buf) + n : end;
+}
+
+// Walk a packed journal segment from its start to the last whole block at
+// or before limit and return where that is. h and meters are left with the
+// header in force there (h.tag 0 if none), cut with whether the walk 
+// stopped at limit rather than at the end of the records.
+unsigned long walk_journal(File &fp, unsigned long limit, log_header &h, log_meter *meters, boolean &cut)
+{
+  unsigned long pos = 0;
+  unsigned long next;
+  int tag;
+  
+  h.tag = 0;
+  cut = false;
+  fp.seek(0);
+  while(pos < limit && (tag = fp.read()) >= 0)
+  {
+    if(tag == LOG_TAG_HEADER)
+    {
+      h.tag = 0; // until the whole header is in
+      if(!read_log_header(fp, h, meters))
+        break;
+      next = fp.position();
+    }
+    else if(tag == LOG_TAG_RECORD && h.tag)
+      next = pos + log_record_size(h);
+    else
+      break;
+    
+    if(next > fp.size() || (tag == LOG_TAG_RECORD && !log_record_whole(fp, pos, h)))
+      break;
+    if(next > limit)
+    {
+      cut = true;
+      break;
+    }
+    if(tag == LOG_TAG_HEADER)
+      h.tag = tag;
+    pos = next;
+    fp.seek(pos);
+  }
+  
+  return pos;
+}
+
+// Bring ts_buf up to date for time ts and return the length of the timestamp
+// in it, with milliseconds if with_ms. Only the digits that changed since the 
+// last call are rewritten, usually just the seconds.
+byte format_timestamp(time_t ts, word ms, boolean with_ms)
+{
+  byte len = 19;
+  
+  if(ts != ts_last)
+  {
+    if(!ts_last || elapsedDays(ts) != elapsedDays(ts_last))
+    {
+      put_digits(&ts_buf[0], year(ts), 4);
+      put_digits(&ts_buf[5], month(ts), 2);
+      put_digits(&ts_buf[8], day(ts), 2);
+    }
+    if(ts / SECS_PER_HOUR != ts_last / SECS_PER_HOUR)
+      put_digits(&ts_buf[11], hour(ts), 2);
+    if(ts / SECS_PER_MIN != ts_last / SECS_PER_MIN)
+      put_digits(&ts_buf[14], minute(ts), 2);
+    put_digits(&ts_buf[17], second(ts), 2);
+    ts_last = ts;
+  }
+  
+  if(with_ms)
+  {
+    ts_buf[len++] = '.';
+    put_digits(&ts_buf[len], ms, 3);
+    len += 3;
+  }
+  memcpy(&ts_buf[len], " UTC", 4);
+  
+  return len + 4;
+}
+
+// Zero padded decimal, n digits
+void put_digits(char *p, word val, byte n)
+{
+  while(n--)
+  {
+    p[n] = '0' + val % 10;
+    val /= 10;
+  }
+}
+
+// The JSON lines of this reading
+void print_it(Print &printer)
+{
+  byte ts_len = format_timestamp(t, t_ms, read_periods[read_rate] < 1000);
+  
+  for(int i = 0; i < meter_count; i++)  
+  {
+    log_aggregate agg;
+    
+    agg.power_min = log_min[i];
+    agg.power_max = log_max[i];
+    agg.energy_int = log_energy[i];
+    agg.samples = log_count[i];
+    print_reading(printer, meter_id[i], ts_len, readings[i], aggregate ? &agg : NULL);
+  }
+}
+
+// One meter's JSON line, stamped with the first ts_len characters of ts_buf
+void print_reading(Print &printer, const char *id, byte ts_len, const float *values, const log_aggregate *agg)
+{
+  printer.print("{\"meter\": \"");
+  printer.print(id);
+  printer.print("\", \"ts\": \"");
+  printer.write((const uint8_t *)ts_buf, ts_len);
+  printer.print("\", ");
+  
+  for(int j = 0; j < MAX_MEASURES; j++)
+  {
+    printer.print("\"");
+    printer.print(measure_types[j]);
+    printer.print("\": "); 
+    printer.print(values[j]);
+    printer.print(", ");
+  }
+  
+  if(agg)
+  {
+    printer.print("\"power_min\": ");
+    printer.print(agg->power_min);
+    printer.print(", \"power_max\": ");
+    printer.print(agg->power_max);
+    printer.print(", \"samples\": ");
+    printer.print(agg->samples);
+    printer.print(", \"energy_int\": ");
+    printer.print(agg->energy_int, 4);
+    printer.print(", ");
+  }
+  printer.print("},\r\n");
+}
+
+boolean send_file(char *fname, EthernetClient client)
+{
+  File fp;
+
+  if(!(fp = SD.open(fname, FILE_READ)))
+  {
+    Serial.print("ERROR: (D3) unable to open SD card file: ");
+    Serial.println(fname);
+    return false;
+  }
+
+  client.println("HTTP/1.1 200 OK");
+  if(strstr(fname, ".bin"))
+    client.println("Content-Type: application/octet-stream");
+  else
+    client.println("Content-Type: text/plain");
+  client.print("Content-Length: ");
+  client.println(fp.size());
+  client.println();
+      
+  send_stream(fp, client, fp.size());
+
+  fp.close();
+  delay(1);
+  return true;
+}
+
+// Send len bytes of a file from where it is down a connection, a sector at 
+// a time
+unsigned long send_stream(File &fp, Client &out, unsigned long len)
+{
+  uint8_t buf[STREAM_BUFFER_SIZE];
+  
+  return stream_copy(fp, out, buf, sizeof(buf), len);
+}
+
+// Everything in the journal the web service has not acknowledged
+boolean send_unsent(EthernetClient client)
+{
+  unsigned long len = 0;
+  char name[24];
+  File fp;
+  
+  for(unsigned long n = ack_seg; n <= journal_last; n++)
+  {
+    journal_name(name, n);
+    if(fp = SD.open(name, FILE_READ))
+    {
+      len += fp.size() - (n == ack_seg ? ack_off : 0);
+      fp.close();
+    }
+  }
+  if(!len)
+    return false;
+  
+  // packed, the journal is in the daily logs' format, see log_format.h
+  client.println("HTTP/1.1 200 OK");
+  if(upload_format == UPLOAD_PACKED)
+    client.println("Content-Type: application/octet-stream");
+  else
+    client.println("Content-Type: text/plain");
+  client.print("Content-Length: ");
+  client.println(len);
+  client.println();
+  
+  for(unsigned long n = ack_seg; n <= journal_last && len; n++)
+  {
+    journal_name(name, n);
+    if(fp = SD.open(name, FILE_READ))
+    {
+      fp.seek(n == ack_seg ? ack_off : 0);
+      len -= send_stream(fp, client, len);
+      fp.close();
+    }
+  }
+  
+  delay(1);
+  return true;
+}
+
+// An upload is a batch of the unsent journal wrapped in this envelope
+#define JSON_HEAD_1 "{\"metering\": {\"home\": \""
+#define JSON_HEAD_2 "\", \"readings\": [\r\n"
+#define JSON_TAIL "] } }\r\n"
+
+// Time for an upload: a backlog is still draining, or the upload period is
+// up (with upload_rate 0, records have just reached the card)
+boolean upload_due()
+{
+  unsigned long period = upload_periods[upload_rate];
+  
+  if(unsent_more)
+    return true;
+  if(!period)
+    return upload_now;
+  return millis() - upload_at >= period;
+}
+
+// Work out the next batch of the journal and start its upload: from the 
+// cursor through whole segments, cut after a whole line (or packed block) 
+// where it reaches UPLOAD_MAX_BYTES. Returns false if there is nothing to 
+// send.
+boolean start_upload()
+{
+  unsigned long budget = UPLOAD_MAX_BYTES;
+  unsigned long off = ack_off;
+  char name[24];
+  File fp;
+  
+  upload_now = false;
+  upload_at = millis();
+  unsent_more = false;
+  if(upload_periods[upload_rate])
+    flush_logs(); // the latest records go too
+  
+  up_bytes = 0;
+  up_full = false;
+  up_end_seg = ack_seg;
+  up_end_off = ack_off;
+  for(unsigned long seg = ack_seg; seg <= journal_last; seg++, off = 0)
+  {
+    journal_name(name, seg);
+    if(!(fp = SD.open(name, FILE_READ)))
+    {
+      // a lost segment cannot be sent, the cursor passes over it
+      Serial.print("ERROR: (D1) unable to open SD card file: ");
+      Serial.println(name);
+      continue;
+    }
+    
+    unsigned long end;
+    boolean cut;
+    
+    // a packed segment's records can end before the file does, if a block 
+    // was torn; the rest is passed over
+    if(upload_format == UPLOAD_PACKED)
+    {
+      end = max(walk_journal(fp, off + budget, up_header, up_meters, cut), off);
+    }
+    else
+    {
+      end = batch_end(fp, off, budget);
+      cut = end < fp.size();
+    }
+    
+    fp.close();
+    up_bytes += end - off;
+    budget -= end - off;
+    up_end_seg = seg;
+    up_end_off = end;
+    if(cut)
+    {
+      up_full = true;
+      break;
+    }
+  }
+  
+  if(!up_bytes)
+  {
+    // nothing new, but finished or lost segments can go
+    if(up_end_seg != ack_seg)
+      ack_journal(up_end_seg, up_end_off);
+    return false;
+  }
+  
+  // the packed size is only known once it is sent
+  up_chunked = upload_format == UPLOAD_PACKED || up_bytes > UPLOAD_CHUNKED_OVER;
+  up_base = now();
+  up_started = millis();
+  up_attempt = 0;
+  up_state = UP_CONNECT;
+  return true;
+}
+
+// Open journal segment up_seg to send from offset off, setting up_left to
+// the bytes of the batch in it. Packed, the meter table in force at off is
+// the first thing to go.
+void open_upload_segment(unsigned long off)
+{
+  char name[24];
+  
+  journal_name(name, up_seg);
+  up_left = 0;
+  if(up_fp = SD.open(name, FILE_READ))
+  {
+    up_left = (up_seg == up_end_seg ? up_end_off : up_fp.size()) - off;
+    if(upload_format == UPLOAD_PACKED)
+    {
+      boolean cut;
+      
+      walk_journal(up_fp, off, up_header, up_meters, cut);
+      up_table = up_header.tag != 0;
+      up_meter = MAX_METERS;
+    }
+    up_fp.seek(off);
+  }
+}
+
+// Send a piece of the body, framed as a chunk if the upload is chunked
+void send_upload_chunk(const uint8_t *data, word len)
+{
+  if(!len)
+    return; // an empty chunk would end the body
+  if(up_chunked)
+  {
+    ws_client.print(len, HEX);
+    ws_client.print("\r\n");
+  }
+  ws_client.write(data, len);
+  if(up_chunked)
+    ws_client.print("\r\n");
+  ws_bytes += len;
+}
+
+void send_upload_piece(const char *text)
+{
+  send_upload_chunk((const uint8_t *)text, strlen(text));
+}
+
+// Append v to p as a varint, see log_format.h. 64 bit arithmetic is slow 
+// here and only needed for gaps of weeks between records.
+void pack_varint(uint8_t *&p, unsigned long long v)
+{
+  unsigned long w;
+  
+  for(; v >> 32; v >>= 7)
+    *p++ = (uint8_t)v | 0x80;
+  for(w = v; w >= 0x80; w >>= 7)
+    *p++ = (uint8_t)w | 0x80;
+  *p++ = w;
+}
+
+void pack_svarint(uint8_t *&p, long v)
+{
+  pack_varint(p, ((unsigned long)v << 1) ^ (unsigned long)(v >> 31));
+}
+
+// A value in fixed point, held to BATCH_FIXED_MAX
+long pack_fixed(float v, float scale)
+{
+  v *= scale;
+  if(v > BATCH_FIXED_MAX)
+    return BATCH_FIXED_MAX;
+  if(v < -BATCH_FIXED_MAX)
+    return -BATCH_FIXED_MAX;
+  return (long)(v < 0 ? v - 0.5 : v + 0.5);
+}
+
+// Pack the blocks of up_seg that follow into out, as many as surely fit in
+// room; a record may be left part way, up_meter is where it goes on. 
+// Returns the bytes packed, or -1 if the card could not be read.
+int pack_records(uint8_t *out, word room)
+{
+  uint8_t *p = out;
+  int tag;
+  
+  while(true)
+  {
+    word left = room - (p - out);
+    
+    if(up_table)
+    {
+      if(left < PACK_TABLE_MAX)
+        break;
+      *p++ = BATCH_TAG_TABLE;
+      *p++ = up_header.meter_count;
+      *p++ = up_header.measure_count;
+      *p++ = up_header.flags;
+      pack_varint(p, up_header.period_ms);
+      for(int i = 0; i < up_header.meter_count; i++, p += 4)
+        memcpy(p, up_meters[i].id, 4);
+      memset(up_cols, 0, sizeof(up_cols));
+      up_table = false;
+    }
+    else if(up_meter < up_header.meter_count)
+    {
+      float values[MAX_MEASURES];
+      log_aggregate a;
+      
+      if(left < PACK_METER_MAX)
+        break;
+      if(up_fp.read(values, sizeof(values)) != sizeof(values))
+        return -1;
+      for(int j = 0; j < MAX_MEASURES; j++)
+      {
+        long v = pack_fixed(values[j], BATCH_SCALE);
+        
+        pack_svarint(p, v - up_cols[up_meter][j]);
+        up_cols[up_meter][j] = v;
+      }
+      if(up_header.flags & LOG_FLAG_AGGREGATE)
+      {
+        if(up_fp.read(&a, sizeof(a)) != sizeof(a))
+          return -1;
+        pack_svarint(p, pack_fixed(a.power_min, BATCH_SCALE) - up_cols[up_meter][MTYPE_W]);
+        pack_svarint(p, pack_fixed(a.power_max, BATCH_SCALE) - up_cols[up_meter][MTYPE_W]);
+        pack_varint(p, a.samples);
+        pack_svarint(p, pack_fixed(a.energy_int, BATCH_SCALE_ENERGY_INT));
+      }
+      if(++up_meter == up_header.meter_count && up_fp.read() != LOG_RECORD_END)
+        return -1;
+    }
+    else if(!up_left || left < PACK_HEAD_MAX)
+    {
+      break;
+    }
+    else if((tag = up_fp.read()) == LOG_TAG_HEADER)
+    {
+      up_header.tag = 0;
+      if(!read_log_header(up_fp, up_header, up_meters) || 
+         up_left < sizeof(log_header) + up_header.meter_count * sizeof(log_meter))
+      {
+        up_left = 0; // a torn header, nothing after it was in the batch
+        break;
+      }
+      up_header.tag = tag;
+      up_left -= sizeof(log_header) + up_header.meter_count * sizeof(log_meter);
+      up_table = true;
+    }
+    else if(tag == LOG_TAG_RECORD && up_header.tag && up_left >= log_record_size(up_header))
+    {
+      unsigned long ms;
+      
+      if(up_fp.read(&ms, sizeof(ms)) != sizeof(ms))
+        return -1;
+      
+      time_t ts = up_header.base_time + ms / 1000;
+      long long dt = (long long)(long)(ts - up_time) * 1000 + (int)(ms % 1000) - (int)up_time_ms;
+      
+      *p++ = BATCH_TAG_RECORD;
+      pack_varint(p, ((unsigned long long)dt << 1) ^ (unsigned long long)(dt >> 63));
+      up_time = ts;
+      up_time_ms = ms % 1000;
+      up_left -= log_record_size(up_header);
+      up_meter = 0;
+      if(!up_header.meter_count && up_fp.read() != LOG_RECORD_END)
+        return -1;
+    }
+    else
+    {
+      up_left = 0; // a torn block, nothing after it was in the batch
+      break;
+    }
+  }
+  
+  return p - out;
+}
+
+// Advance the upload by one step
+void upload_step()
+{
+  if(uplink == UPLINK_MQTT)
+  {
+    mqtt_step();
+    return;
+  }
+  
+  switch(up_state)
+  {
+    case UP_CONNECT:
+      up_reused = ws_client.connected();
+      if(!up_reused && !uplink_open())
+      {
+        ws_failures++;
+        end_upload(false);
+        return;
+      }
+      up_at = millis();
+      up_state = UP_OPEN;
+      // a connection left open goes on to the headers straight away
+      
+    case UP_OPEN:
+      if(!up_reused)
+      {
+        int opened = uplink_opened();
+        
+        if(!opened && millis() - up_at <= UPLINK_OPEN_TIMEOUT)
+          return;
+        if(opened <= 0)
+        {
+          uplink_failed();
+          ws_failures++;
+          end_upload(false);
+          return;
+        }
+      }
+      
+      // the envelope is streamed around the batch, never stored
+      ws_client.print("POST ");
+      ws_client.print(ws_url);
+      ws_client.println(" HTTP/1.1");
+      ws_client.print("Host: ");
+      ws_client.println(ws_host);
+      if(up_chunked)
+      {
+        ws_client.println("Transfer-Encoding: chunked");
+      }
+      else
+      {
+        ws_client.print("Content-Length: ");
+        ws_client.println(sizeof(JSON_HEAD_1) - 1 + strlen(home_id) + sizeof(JSON_HEAD_2) - 1 + up_bytes + sizeof(JSON_TAIL) - 1);
+      }
+      ws_client.print("Content-Type: ");
+      ws_client.println(upload_format == UPLOAD_PACKED ? BATCH_CONTENT_TYPE : "text/plain");
+      ws_client.println("Connection: keep-alive");
+      ws_client.println();
+      
+      if(upload_format == UPLOAD_PACKED)
+      {
+        batch_header b;
+        
+        memcpy(b.magic, BATCH_MAGIC, sizeof(b.magic));
+        b.version = BATCH_VERSION;
+        memcpy(b.home_id, home_id, sizeof(b.home_id));
+        b.base_time = up_base;
+        send_upload_chunk((const uint8_t *)&b, sizeof(b));
+        up_time = up_base;
+        up_time_ms = 0;
+      }
+      else
+      {
+        send_upload_piece(JSON_HEAD_1);
+        send_upload_piece(home_id);
+        send_upload_piece(JSON_HEAD_2);
+      }
+      up_fp.close(); // from an attempt on a connection that had gone
+      up_seg = ack_seg;
+      open_upload_segment(ack_off);
+      
+      up_keep = true;
+      up_in_headers = true;
+      up_got_any = false;
+      up_body = -1;
+      up_body_chunked = false;
+      up_chunk_stage = CHUNK_SIZE;
+      up_chunk_left = 0;
+      up_chunk_ext = false;
+      up_line_len = 0;
+      memset(up_text, 0, sizeof(up_text));
+      up_at = millis();
+      up_state = UP_BODY;
+      break;
+      
+    case UP_BODY:
+    {
+      // a sector per pass (packed, what fits in one), as a chunk: size 
+      // line, data and CRLF in one write so it is one packet
+      uint8_t buf[STREAM_BUFFER_SIZE + 7];
+      uint8_t *data = up_chunked ? &buf[5] : buf;
+      boolean packing = upload_format == UPLOAD_PACKED && (up_table || up_meter < up_header.meter_count);
+      int n = 0;
+      
+      if(upload_format == UPLOAD_PACKED)
+        n = pack_records(data, STREAM_BUFFER_SIZE);
+      else if(up_left)
+        n = up_fp.read(data, min(up_left, (unsigned long)STREAM_BUFFER_SIZE));
+      if(n > 0)
+      {
+        word len = n;
+        
+        if(up_chunked)
+        {
+          sprintf((char *)buf, "%03X\r", n);
+          buf[4] = '\n';
+          data[len++] = '\r';
+          data[len++] = '\n';
+          len += 5;
+        }
+        if(ws_client.write(buf, len) != len)
+        {
+          // the connection went, what was sent of the batch is no use
+          ws_client.stop();
+          finish_upload();
+          return;
+        }
+        if(upload_format != UPLOAD_PACKED)
+          up_left -= n;
+        ws_bytes += n;
+      }
+      else if(n < 0 || up_left || packing)
+      {
+        // the segment is shorter than when the batch was worked out
+        ws_client.stop();
+        finish_upload();
+        return;
+      }
+      
+      packing = upload_format == UPLOAD_PACKED && (up_table || up_meter < up_header.meter_count);
+      if(!up_left && !packing)
+      {
+        up_fp.close();
+        if(up_seg != up_end_seg)
+        {
+          up_seg++;
+          open_upload_segment(0);
+          break;
+        }
+        
+        if(upload_format == UPLOAD_PACKED)
+        {
+          uint8_t tag = BATCH_TAG_END;
+          
+          send_upload_chunk(&tag, 1);
+        }
+        else
+          send_upload_piece(JSON_TAIL);
+        if(up_chunked)
+          ws_client.print("0\r\n\r\n");
+        up_at = millis();
+        up_state = UP_REPLY;
+      }
+      break;
+    }
+      
+    case UP_REPLY:
+      for(int i = 0; i < UPLOAD_READ_MAX && ws_client.available(); i++)
+      {
+        if(reply_char(ws_client.read()))
+        {
+          finish_upload();
+          return;
+        }
+        up_at = millis();
+      }
+      
+      if((!ws_client.available() && !ws_client.connected()) || millis() - up_at > UPLOAD_TIMEOUT)
+        finish_upload();
+      break;
+  }
+}
+
+// Take in a byte of the web service's reply to a POST, which is read as far
+// as its Content-Length, or its last chunk, so the connection can carry the
+// next one. Returns true at the end of the reply.
+boolean reply_char(char c)
+{
+  up_got_any = true;
+  
+  if(up_in_headers)
+  {
+    if(c == '\n')
+    {
+      up_line[up_line_len] = 0;
+      if(!up_line_len)
+      {
+        // blank line, the body follows
+        up_in_headers = false;
+        if(up_body_chunked)
+          up_body = -1; // a Content-Length alongside is not to be trusted
+        else if(!up_body)
+          return true;
+      }
+      else if(!strncasecmp(up_line, "Content-Length:", 15))
+        up_body = atol(&up_line[15]);
+      else if(!strncasecmp(up_line, "Transfer-Encoding:", 18) && strstr(up_line, "chunked"))
+        up_body_chunked = true;
+      else if(!strncasecmp(up_line, "Connection:", 11) && strstr(up_line, "close"))
+        up_keep = false;
+      up_line_len = 0;
+    }
+    else if(c != '\r' && up_line_len < sizeof(up_line) - 1)
+      up_line[up_line_len++] = c;
+    return false;
+  }
+  
+  // only the data of a chunked body goes to up_text; it ends at the blank
+  // line after the zero size chunk and its trailers
+  if(up_body_chunked)
+  {
+    switch(up_chunk_stage)
+    {
+      case CHUNK_SIZE:
+        if(c == '\n')
+        {
+          up_chunk_stage = up_chunk_left ? CHUNK_DATA : CHUNK_TRAILER;
+          up_chunk_ext = false;
+          up_line_len = 0;
+        }
+        else if(!up_chunk_ext && isxdigit(c))
+          up_chunk_left = 16 * up_chunk_left + (isdigit(c) ? c - '0' : (c | 0x20) - 'a' + 10);
+        else if(c != '\r')
+          up_chunk_ext = true;
+        return false;
+        
+      case CHUNK_DATA:
+        if(!--up_chunk_left)
+          up_chunk_stage = CHUNK_DATA_END;
+        break;
+        
+      case CHUNK_DATA_END:
+        if(c == '\n')
+          up_chunk_stage = CHUNK_SIZE;
+        return false;
+        
+      case CHUNK_TRAILER:
+        if(c != '\n')
+        {
+          if(c != '\r')
+            up_line_len++;
+          return false;
+        }
+        if(up_line_len)
+        {
+          up_line_len = 0;
+          return false;
+        }
+        up_body = 0; // read to its end, the connection can be kept
+        return true;
+    }
+  }
+  
+  for(int i = 0; i < 7; i++)
+    up_text[i] = up_text[i+1];      
+  up_text[7] = c;
+  
+  return up_body > 0 && !--up_body;
+}
+
+// The reply is in, cut short or overdue: acknowledge the batch if it ends
+// in SUCCESS, or try once more if a reused connection turned out to be dead
+void finish_upload()
+{
+  // without a length the reply ends when the server closes, and a reply cut 
+  // short leaves the connection out of step
+  if(up_state != UP_REPLY || up_body != 0)
+    up_keep = false;
+  if(!up_keep)
+    ws_client.stop();
+  
+  if(!up_got_any && up_reused && !up_attempt)
+  {
+    up_attempt++;
+    ws_reuses++;
+    up_state = UP_CONNECT;
+    return;
+  }
+  if(up_reused)
+    ws_reuses++;
+  
+  ws_posts++;
+  ws_last_ms = millis() - up_started;
+  ws_max_ms = max(ws_max_ms, ws_last_ms);
+  
+  if(up_state == UP_REPLY && !strcmp(up_text, "SUCCESS\n"))
+  {
+    end_upload(true);
+  }
+  else
+  {
+    Serial.println("ERROR: (D4) unable POST to web service");
+    ws_failures++;
+    end_upload(false);
+  }
+}
+
+// Done with the upload; on success move the cursor past the batch
+void end_upload(boolean ok)
+{
+  up_fp.close();
+  up_state = UP_IDLE;
+  
+  if(ok)
+  {
+    ack_journal(up_end_seg, up_end_off);
+    unsent_more = up_full;
+  }
+}
+
+// Start connecting ws_client to the web service (or broker), looking ws_host
+// up first if its address is not known. Nothing here waits on the network,
+// uplink_opened() is polled until the connection is up. ws_host is looked up
+// again only after a connection to it fails. Returns false if it cannot even
+// be started.
+boolean uplink_open()
+{
+  DNSClient dns;
+  
+  ws_client.stop();
+  
+  // a dotted address needs no lookup
+  if(!ws_ip_ok && dns.inet_aton(ws_host, ws_ip))
+    ws_ip_ok = true;
+  if(ws_ip_ok)
+    return uplink_syn();
+  
+  ws_lookups++;
+  if(!dns_query(ws_host))
+    return false;
+  ws_link = LINK_LOOKUP;
+  return true;
+}
+
+// How the connection uplink_open() started is getting on: 1 once it is up, 
+// 0 while it is still being opened, -1 if it cannot be
+int uplink_opened()
+{
+  switch(ws_link)
+  {
+    case LINK_LOOKUP:
+      switch(dns_answer(ws_ip))
+      {
+        case 0:
+          return 0;
+          
+        case -1:
+          return -1;
+      }
+      ws_ip_ok = true;
+      return uplink_syn() ? 0 : -1;
+      
+    case LINK_OPENING:
+      switch(ws_client.status())
+      {
+        case SnSR::ESTABLISHED:
+          ws_link = LINK_IDLE;
+          ws_connects++;
+          return 1;
+          
+        case SnSR::CLOSED:
+          // refused, or the W5100 gave up retrying
+          ws_ip_ok = false;
+          return -1;
+      }
+      return 0;
+  }
+  
+  return -1;
+}
+
+// Give up on opening the connection, whatever it had got to
+void uplink_failed()
+{
+  if(ws_link == LINK_OPENING)
+    ws_ip_ok = false;
+  if(ws_link == LINK_LOOKUP)
+    dns_udp.stop();
+  ws_link = LINK_IDLE;
+  ws_client.stop();
+  
+  Serial.print("ERROR: (D2) unable to connect to web server: ");
+  Serial.print(ws_host);
+  Serial.print(", port: ");
+  Serial.println(ws_port);
+}
+
+// Have the W5100 open a connection to ws_ip on a free socket, the way
+// EthernetClient::connect() does but without waiting for it to be up
+boolean uplink_syn()
+{
+  uint8_t addr[4] = { ws_ip[0], ws_ip[1], ws_ip[2], ws_ip[3] };
+  byte s;
+  
+  for(s = 0; s < MAX_SOCK_NUM; s++)
+  {
+    byte st = W5100.readSnSR(s);
+    
+    if(st == SnSR::CLOSED || st == SnSR::FIN_WAIT || st == SnSR::CLOSE_WAIT)
+      break;
+  }
+  if(s == MAX_SOCK_NUM)
+    return false;
+  
+  // a port of its own each time, so a late segment of the last connection
+  // is not taken for this one
+  if(++ws_port_out < 49152)
+    ws_port_out = 49152;
+  socket(s, SnMR::TCP, ws_port_out, 0);
+  if(!connect(s, addr, ws_port))
+    return false;
+  
+  ws_client = EthernetClient(s);
+  ws_link = LINK_OPENING;
+  return true;
+}
+
+// Send the DNS server a query for the address of host (RFC 1035 4.1), the
+// answer is polled for with dns_answer()
+boolean dns_query(const char *host)
+{
+  uint8_t head[12] = { 0, 0, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0 }; // recursion desired, one question
+  static const uint8_t tail[5] = { 0, 0, 1, 0, 1 }; // end of the name, type A, class IN
+  
+  dns_id++;
+  head[0] = highByte(dns_id);
+  head[1] = lowByte(dns_id);
+  
+  if(!dns_udp.begin(DNS_LOCAL_PORT))
+    return false;
+  if(!dns_udp.beginPacket(Ethernet.dnsServerIP(), DNS_PORT))
+  {
+    dns_udp.stop();
+    return false;
+  }
+  dns_udp.write(head, sizeof(head));
+  
+  // the name as labels, each after its length
+  while(*host)
+  {
+    byte len = strcspn(host, ".");
+    
+    dns_udp.write(len);
+    dns_udp.write((const uint8_t *)host, len);
+    host += len;
+    if(*host)
+      host++;
+  }
+  dns_udp.write(tail, sizeof(tail));
+  
+  if(!dns_udp.endPacket())
+  {
+    dns_udp.stop();
+    return false;
+  }
+  return true;
+}
+
+// Skip a name in a DNS message: labels up to an empty one or a pointer
+void dns_skip_name()
+{
+  int len;
+  
+  while((len = dns_udp.read()) > 0)
+  {
+    if((len & 0xC0) == 0xC0)
+    {
+      dns_udp.read();
+      return;
+    }
+    while(len--)
+      dns_udp.read();
+  }
+}
+
+// The answer to dns_query(), read without waiting for it: 1 with the first
+// address given in ip, 0 if it has not come yet, -1 if there is none
+int dns_answer(IPAddress &ip)
+{
+  uint8_t head[12];
+  word answers;
+  
+  if(!dns_udp.parsePacket())
+    return 0;
+  
+  // anything but the answer to this query is passed over
+  if(dns_udp.read(head, sizeof(head)) != sizeof(head) || word(head[0], head[1]) != dns_id || !(head[2] & 0x80))
+    return 0;
+  
+  // an error, or no address for the name
+  answers = word(head[6], head[7]);
+  if((head[3] & 0x0F) || !answers)
+  {
+    dns_udp.stop();
+    return -1;
+  }
+  
+  // the question as it was sent, then the answers: name, type, class, 
+  // TTL, data length and the data
+  dns_skip_name();
+  for(int i = 0; i < 4; i++)
+    dns_udp.read();
+  while(answers--)
+  {
+    uint8_t rr[10];
+    word len;
+    
+    dns_skip_name();
+    if(dns_udp.read(rr, sizeof(rr)) != sizeof(rr))
+      break;
+    len = word(rr[8], rr[9]);
+    if(word(rr[0], rr[1]) == 1 && word(rr[2], rr[3]) == 1 && len == 4)
+    {
+      uint8_t a[4];
+      
+      if(dns_udp.read(a, sizeof(a)) != sizeof(a))
+        break;
+      ip = IPAddress(a[0], a[1], a[2], a[3]);
+      dns_udp.stop();
+      return 1;
+    }
+    
+    // a CNAME, followed by the address it stands for
+    while(len--)
+      dns_udp.read();
+  }
+  
+  dns_udp.stop();
+  return -1;
+}
+
+// Advance an upload over MQTT by one step. Each line of the batch is a QoS 1
+// PUBLISH to its meter's topic, written a sector of packets at a time; the
+// batch is acknowledged once the broker has sent a PUBACK for every one.
+void mqtt_step()
+{
+  switch(up_state)
+  {
+    case UP_CONNECT:
+      up_reused = ws_client.connected();
+      if(!up_reused && !uplink_open())
+      {
+        ws_failures++;
+        end_upload(false);
+        return;
+      }
+      up_at = millis();
+      up_state = UP_OPEN;
+      // a connection left open goes on to the session straight away
+      
+    case UP_OPEN:
+      if(!up_reused)
+      {
+        int opened = uplink_opened();
+        
+        if(!opened && millis() - up_at <= UPLINK_OPEN_TIMEOUT)
+          return;
+        if(opened <= 0)
+        {
+          uplink_failed();
+          ws_failures++;
+          end_upload(false);
+          return;
+        }
+      }
+      
+      up_fp.close(); // from an attempt on a connection that had gone
+      up_seg = ack_seg;
+      open_upload_segment(ack_off);
+      up_sent = 0;
+      up_acked = 0;
+      memset(up_pubacks, 0, sizeof(up_pubacks));
+      up_got_any = false;
+      
+      // a new batch's IDs carry on from the last, so a late PUBACK for
+      // that one is not taken for one of these; they never wrap to 0
+      up_first_id += MQTT_BATCH_MAX;
+      if(up_first_id > 0xFFFF - MQTT_BATCH_MAX)
+        up_first_id = 1;
+      up_at = millis();
+      up_state = UP_BODY;
+      
+      // the session lasts as long as the connection
+      if(!up_reused || !mq_session)
+      {
+        char client_id[16];
+        uint8_t buf[32];
+        byte len;
+        
+        sprintf(client_id, "apmr-%s", home_id);
+        len = mqtt_connect(buf, client_id, MQTT_KEEPALIVE);
+        
+        mq_session = false;
+        mq_stage = 0;
+        ws_client.write(buf, len);
+        mq_sent_at = millis();
+        up_state = UP_CONNACK;
+      }
+      break;
+      
+    case UP_CONNACK:
+      if(!mqtt_read() || millis() - up_at > UPLOAD_TIMEOUT)
+        mqtt_finish(false);
+      break;
+      
+    case UP_BODY:
+    {
+      uint8_t buf[STREAM_BUFFER_SIZE];
+      word len = 0;
+      int n = 0;
+      
+      if(!mqtt_read())
+      {
+        mqtt_finish(false);
+        return;
+      }
+      
+      while(up_left && up_sent < MQTT_BATCH_MAX && (n = mqtt_publish_line(&buf[len], sizeof(buf) - len)) > 0)
+        len += n;
+      if(n < 0 || (len && ws_client.write(buf, len) != len))
+      {
+        // the segment changed under us or the connection went
+        mqtt_finish(false);
+        return;
+      }
+      if(len)
+        mq_sent_at = millis();
+      
+      // a batch of more lines than there are PUBACK bits ends here, the
+      // rest goes in the next
+      if(up_left && up_sent == MQTT_BATCH_MAX)
+      {
+        up_end_seg = up_seg;
+        up_end_off = up_fp.position();
+        up_full = true;
+        up_left = 0;
+      }
+      
+      if(!up_left)
+      {
+        up_fp.close();
+        if(up_seg != up_end_seg)
+        {
+          up_seg++;
+          open_upload_segment(0);
+          break;
+        }
+        up_at = millis();
+        up_state = UP_REPLY;
+      }
+      break;
+    }
+    
+    case UP_REPLY:
+    {
+      boolean alive = mqtt_read();
+      
+      if(up_acked >= up_sent)
+        mqtt_finish(true);
+      else if(!alive || millis() - up_at > UPLOAD_TIMEOUT)
+        mqtt_finish(false);
+      break;
+    }
+  }
+}
+
+// Add the next line of up_seg to out as a PUBLISH to its meter's topic, the
+// reading as a JSON object. Returns the bytes added, 0 if it does not fit 
+// in room, or -1 if the segment is not as it was when the batch was worked 
+// out.
+int mqtt_publish_line(uint8_t *out, word room)
+{
+  unsigned long at = up_fp.position();
+  char *line = (char *)&out[MQTT_HEAD_MAX];
+  char topic[16];
+  char id[5];
+  int n = 0;
+  int len = 0;
+  word payload;
+  byte head;
+  
+  // the line is read in place, then moved up against its header
+  if(room > MQTT_HEAD_MAX)
+    n = up_fp.read(line, min(min(up_left, (unsigned long)JOURNAL_LINE_MAX), (unsigned long)(room - MQTT_HEAD_MAX)));
+  while(len < n && line[len] != '\n')
+    len++;
+  if(len == n)
+  {
+    if(n < 0 || n == JOURNAL_LINE_MAX)
+      return -1;
+    if((unsigned long)n == up_left)
+    {
+      // the end of a line torn by a reset, there is nothing to send
+      up_fp.seek(at + n);
+      up_left = 0;
+      return 0;
+    }
+    up_fp.seek(at);
+    return 0;
+  }
+  len++;
+  up_fp.seek(at + len);
+  up_left -= len;
+  
+  payload = mqtt_json_payload(line, len);
+  
+  id[0] = 0;
+  if(!strncmp(line, "{\"meter\": \"", 11))
+  {
+    byte i = 0;
+    
+    for(; i < sizeof(id) - 1 && line[11 + i] != '"'; i++)
+      id[i] = line[11 + i];
+    id[i] = 0;
+  }
+  sprintf(topic, "%s/%s/%s", MQTT_TOPIC, home_id, id);
+  
+  head = mqtt_publish_head_size(topic, payload);
+  memmove(&out[head], line, payload);
+  mqtt_publish_head(out, topic, up_first_id + up_sent, payload);
+  up_sent++;
+  ws_publishes++;
+  
+  return head + payload;
+}
+
+// Take in what the broker has sent, a few bytes per pass of loop(); CONNACK
+// starts the batch, a PUBACK for each of its publishes ends it. Returns false
+// if the connection has gone or the broker turned the session down.
+boolean mqtt_read()
+{
+  for(int i = 0; i < UPLOAD_READ_MAX && ws_client.available(); i++)
+  {
+    up_got_any = true;
+    up_at = millis();
+    if(!mqtt_char(ws_client.read()))
+      continue;
+    
+    if(mq_type == MQTT_CONNACK && up_state == UP_CONNACK)
+    {
+      if(mq_body[1] != 0)
+      {
+        Serial.print("ERROR: (D5) MQTT broker refused the connection, code ");
+        Serial.println(mq_body[1]);
+        return false;
+      }
+      mq_session = true;
+      up_state = UP_BODY;
+    }
+    else if(mq_type == MQTT_PUBACK)
+    {
+      word n = (((word)mq_body[0] << 8) | mq_body[1]) - up_first_id;
+      
+      // a publish acknowledged twice counts once
+      ws_pubacks++;
+      if(up_state != UP_IDLE && n < up_sent && !bitRead(up_pubacks[n / 8], n % 8))
+      {
+        bitSet(up_pubacks[n / 8], n % 8);
+        up_acked++;
+      }
+    }
+  }
+  
+  return ws_client.available() || ws_client.connected();
+}
+
+// Take in a byte of a packet from the broker, returns true once the packet
+// is all in, its type in mq_type and the start of the rest in mq_body
+boolean mqtt_char(byte c)
+{
+  if(mq_stage == 0)
   {
-    Serial.print("ERROR: (");
-    Serial.print(errno);
-    Serial.print(") unable to open target SD card file: ");
-    Serial.println(target_file);
+    mq_type = c >> 4;
+    mq_left = 0;
+    mq_shift = 0;
+    mq_got = 0;
+    mq_stage = 1;
     return false;
   }
   
-  if(!(sfp = SD.open(source_file, FILE_READ)))
+  if(mq_stage == 1)
   {
-    Serial.print("ERROR: (");
-    Serial.print(errno);
-    Serial.print(") unable to open source SD card file: ");
-    Serial.println(source_file);
-    return false;
+    mq_left |= (unsigned long)(c & 0x7F) << mq_shift;
+    mq_shift += 7;
+    if(c & 0x80)
+      return false;
+    mq_stage = 2;
+    if(mq_left)
+      return false;
   }
-        
-  tfp.print("{\"metering\": {");
-  tfp.print("\"home\": \"");
-  tfp.print(home_id);
-  tfp.print("\", ");
-  tfp.print("\"readings\": [\r\n");
-
-  while(sfp.available())
-    tfp.write(sfp.read());
-
-  tfp.print("] } }\r\n");
-        
-  sfp.close();
-  tfp.close();
-  return true;
-}
-
-boolean send_file(char *fname, EthernetClient client)
-{
-  File fp;
-
-  if(!(fp = SD.open(fname, FILE_READ)))
+  else
   {
-    Serial.print("ERROR: (D3) unable to open SD card file: ");
-    Serial.println(fname);
-    return false;
+    if(mq_got < sizeof(mq_body))
+      mq_body[mq_got++] = c;
+    if(--mq_left)
+      return false;
   }
-
-  client.println("HTTP/1.1 200 OK");
-  client.println("Content-Type: text/plain");
-  client.print("Content-Length: ");
-  client.println(fp.size());
-  client.println();
-      
-  while(fp.available())
-    client.write(fp.read());
-
-  fp.close();
-  delay(1);
+  
+  mq_stage = 0;
   return true;
 }
 
-boolean send_data()
+// Done with an upload over MQTT. A batch not wholly acknowledged goes again
+// in full, on a new session; QoS 1 is at least once anyway.
+void mqtt_finish(boolean ok)
 {
-  File fp;
-  EthernetClient web_server;
-  char *ok_response = "SUCCESS\n";
-  char text[9] = {000000000};
-    
-  if(!(fp = SD.open(sd_json, FILE_READ)))
-  {
-    Serial.print("ERROR: (D1) unable to open SD card file: ");
-    Serial.println(sd_json);
-    return false;
-  }
-  
-  if(!web_server.connect(ws_host, ws_port)) 
+  if(!ok)
   {
-    Serial.print("ERROR: (D2) unable to connect to web server: ");
-    Serial.print(ws_host);
-    Serial.print(", port: ");
-    Serial.println(ws_port);
-    return false;
+    ws_client.stop();
+    mq_session = false;
+    
+    // a connection left open can turn out to have gone, try once more
+    if(!up_got_any && up_reused && !up_attempt)
+    {
+      up_attempt++;
+      ws_reuses++;
+      up_state = UP_CONNECT;
+      return;
+    }
   }
+  if(up_reused)
+    ws_reuses++;
   
-  web_server.print("POST ");
-  web_server.print(ws_url);
-  web_server.println(" HTTP/1.1");
-  web_server.print("Host: ");
-  web_server.println(ws_host);
-  web_server.print("Content-Length: ");
-  web_server.println(fp.size());
-  web_server.println("Content-Type: text/plain");
-  web_server.println("Connection: close");
-  web_server.println();
-  
-  while(fp.available())
-    web_server.write(fp.read());
-  fp.close();
+  ws_posts++;
+  ws_last_ms = millis() - up_started;
+  ws_max_ms = max(ws_max_ms, ws_last_ms);
   
-  while(web_server.connected()) 
+  if(!ok)
   {
-    if(web_server.available())
-    {
-      char c = web_server.read();
-    
-      for(int i = 0; i < 7; i++)
-        text[i] = text[i+1];      
-      text[7] = c;
-    }
-  } 
+    Serial.println("ERROR: (D5) unable to publish to MQTT broker");
+    ws_failures++;
+  }
+  end_upload(ok);
+}
 
-  // send successfully, delete unsent temp file
-  if(!strcmp(text, ok_response))
+// Between uploads keep the MQTT session alive and take in what the broker
+// sends (late PUBACKs, PINGRESPs)
+void mqtt_idle()
+{
+  if(!mq_session)
+    return;
+  if(!ws_client.connected())
   {
-    SD.remove(sd_unsent);
+    ws_client.stop();
+    mq_session = false;
+    return;
   }
-  else
-  {
-    Serial.print("ERROR: (D4) unable POST to web service");
-    return false;
-  }  
   
-  web_server.stop();  
-  delay(1);
-  return true;
+  mqtt_read();
+  if(millis() - mq_sent_at > MQTT_PING_SECS * 1000UL)
+  {
+    uint8_t ping[2] = { MQTT_PINGREQ << 4, 0 };
+    
+    ws_client.write(ping, sizeof(ping));
+    mq_sent_at = millis();
+  }
 }
 
 void print_html_sep(EthernetClient client)
 {
-  client.print("<br/><br/>");
+  client.print(F("<br/><br/>"));
 }
 
-void print_html_input(EthernetClient client, char *prompt, char *name, int inst, int len, char *value, char *eg)
+void print_html_input(EthernetClient client, const __FlashStringHelper *prompt, char *name, int inst, int len, char *value, const __FlashStringHelper *eg)
 {
   if(prompt != NULL)
   {
     client.print(prompt);
-    client.print(":&nbsp;");
+    client.print(F(":&nbsp;"));
   }
   
-  client.print("<input type=\"text\" name=\"");
+  client.print(F("<input type=\"text\" name=\""));
   client.print(name);
   if(inst > 0)
     client.print(inst);
-  client.print("\" size=\"");
+  client.print(F("\" size=\""));
   client.print(len);
-  client.print("\" maxlength=\"");
+  client.print(F("\" maxlength=\""));
   client.print(len);
-  client.print("\" value=\"");
+  client.print(F("\" value=\""));
   client.print(value);
-  client.print("\"/>");
+  client.print(F("\"/>"));
   
   if(eg != NULL)
   {
-    client.print("&nbsp;&nbsp;e.g. ");
+    client.print(F("&nbsp;&nbsp;e.g. "));
     client.print(eg);
   }
 }
 
-void print_html_input_set(EthernetClient client, char *prompt, char *nameprefix, int len, byte arr[], int arrsize, char *sep, boolean prnhex)
+void print_html_input_set(EthernetClient client, const __FlashStringHelper *prompt, char *nameprefix, int len, byte arr[], int arrsize, const __FlashStringHelper *sep, boolean prnhex)
 { 
   client.print(prompt);
-  client.print(":&nbsp;");
+  client.print(F(":&nbsp;"));
 
   for(int i = 0; i < arrsize; i++)
   {
-    client.print("<input type=\"text\" style=\"text-align:center\" name=\"");
+    client.print(F("<input type=\"text\" style=\"text-align:center\" name=\""));
     client.print(nameprefix);
     client.print(i+1);
-    client.print("\" size=\"");
+    client.print(F("\" size=\""));
     client.print(len);
-    client.print("\" maxlength=\"");
+    client.print(F("\" maxlength=\""));
     client.print(len);
-    client.print("\" value=\"");
+    client.print(F("\" value=\""));
 
     if(arr != NULL && !prnhex)
     { 
@@ -461,7 +2757,7 @@ void print_html_input_set(EthernetClient client, char *prompt, char *nameprefix,
       client.print(arr[i], HEX);
     }
 
-    client.print("\"/>");
+    client.print(F("\"/>"));
     
     if(i < arrsize - 1)
       client.print(sep);
@@ -473,132 +2769,226 @@ void write_settings_page(EthernetClient client)
   char num[8];
   int i;
   
-  client.println("HTTP/1.1 200 OK");
-  client.println("Content-Type: text/html");
+  client.println(F("HTTP/1.1 200 OK"));
+  client.println(F("Content-Type: text/html"));
   client.println();
   
-  client.print("<html><body>");
-  client.print("<form action=\"http://");
+  client.print(F("<html><body>"));
+  client.print(F("<form action=\"http://"));
   client.print(Ethernet.localIP());
-  client.print("/settings\" method=\"post\">");
-  client.print("<hr/><h1 style=\"text-align:center\";> APMR Setting Configuration </h1><hr/>");
+  client.print(F("/settings\" method=\"post\">"));
+  client.print(F("<hr/><h1 style=\"text-align:center\";> APMR Setting Configuration </h1><hr/>"));
   print_html_sep(client);
           
-  print_html_input_set(client, "MAC address", "M", 2, mac, sizeof(mac), "&nbsp;:&nbsp;", true);
-  client.print("<blockquote><b>Note:</b>&nbsp;<em>To have APMR use a fixed IP, configure the your DHCP server to assign once based on the above MAC address.</em></blockquote>");
+  print_html_input_set(client, F("MAC address"), "M", 2, mac, sizeof(mac), F("&nbsp;:&nbsp;"), true);
+  client.print(F("<blockquote><b>Note:</b>&nbsp;<em>To have APMR use a fixed IP, configure the your DHCP server to assign once based on the above MAC address.</em></blockquote>"));
  
-  print_html_input(client, "Web server hostname", "HN", 0, 32, ws_host, "my.server.com");
+  client.print(F("Send the readings by:&nbsp;"));
+  client.print(F("<select name=\"uplink\">"));
+  client.print(F("<option value=\"0\""));
+  if(uplink == UPLINK_HTTP)
+    client.print(F(" selected=\"selected\""));
+  client.print(F(">HTTP POST to the web server's URL path </option>"));
+  client.print(F("<option value=\"1\""));
+  if(uplink == UPLINK_MQTT)
+    client.print(F(" selected=\"selected\""));
+  client.print(F(">MQTT 3.1.1 to a broker, topics " MQTT_TOPIC "/HOME ID/METER ID </option>"));
+  client.print(F("</select>"));
+  print_html_sep(client);
+
+  print_html_input(client, F("Web server (or MQTT broker) hostname"), "HN", 0, 32, ws_host, F("my.server.com"));
   print_html_sep(client);
 
   num[0] = 0;
   String(ws_port).toCharArray(num, sizeof(num));
-  print_html_input(client, "Web server port", "PN", 0, 5, num, "80 (default)");
+  print_html_input(client, F("Web server port"), "PN", 0, 5, num, F("80 (default), 1883 for MQTT"));
   print_html_sep(client);
 
-  print_html_input(client, "URL path", "path", 0, 64, ws_url, "/ws/save.py");
+  print_html_input(client, F("URL path"), "path", 0, 64, ws_url, F("/ws/save.py"));
   print_html_sep(client);
 
-  client.print("Serial console baud rate:&nbsp;"); 
-  client.print("<select name=\"cs_rate\">");
+  client.print(F("Serial console baud rate:&nbsp;")); 
+  client.print(F("<select name=\"cs_rate\">"));
   for(i = 0; i < sizeof(baud_rates) / sizeof(long); i++)
   {
-    client.print("<option value=\"");
+    client.print(F("<option value=\""));
     client.print(i);
-    client.print("\"");
+    client.print(F("\""));
 
     if(console_baud_rate == i)
-      client.print(" selected=\"selected\"");
+      client.print(F(" selected=\"selected\""));
 
-    client.print(">");
+    client.print(F(">"));
     client.print(baud_rates[i]);
-    client.print(" </option>"); 
+    client.print(F(" </option>")); 
   }
-  client.print("</select>");
+  client.print(F("</select>"));
   print_html_sep(client);
 
-  client.print("RS485/Modbus baud rate:&nbsp;"); 
-  client.print("<select name=\"mb_rate\">");
+  client.print(F("RS485/Modbus baud rate:&nbsp;")); 
+  client.print(F("<select name=\"mb_rate\">"));
   for(i = 0; i < sizeof(baud_rates) / sizeof(long); i++)
   {
-    client.print("<option value=\"");
+    client.print(F("<option value=\""));
     client.print(i);
-    client.print("\"");
+    client.print(F("\""));
 
     if(rs485_baud_rate == i)
-      client.print(" selected=\"selected\"");
+      client.print(F(" selected=\"selected\""));
 
-    client.print(">");
+    client.print(F(">"));
     client.print(baud_rates[i]);
-    client.print(" </option>"); 
+    client.print(F(" </option>")); 
   }
-  client.print("</select>");
+  client.print(F("</select>"));
   print_html_sep(client);
 
-  client.print("Meter reading rate (1 reading per):&nbsp;");
-  client.print("<select name=\"r_rate\">");
+  client.print(F("Meter reading rate (1 reading per):&nbsp;"));
+  client.print(F("<select name=\"r_rate\">"));
   for(i = 0; i < sizeof(read_rates) / sizeof(char *); i++)
   {
-    client.print("<option value=\"");
+    client.print(F("<option value=\""));
     client.print(i);
-    client.print("\"");
+    client.print(F("\""));
     
     if(read_rate == i)
-      client.print(" selected=\"selected\"");
+      client.print(F(" selected=\"selected\""));
 
-    client.print(">");
+    client.print(F(">"));
     client.print(read_rates[i]);
-    client.print(" </option>"); 
+    client.print(F(" </option>")); 
+  }
+  client.print(F("</select>"));
+  print_html_sep(client);
+
+  client.print(F("Upload to the web server:&nbsp;"));
+  client.print(F("<select name=\"u_rate\">"));
+  for(i = 0; i < UPLOAD_RATE_COUNT; i++)
+  {
+    client.print(F("<option value=\""));
+    client.print(i);
+    client.print(F("\""));
+    
+    if(upload_rate == i)
+      client.print(F(" selected=\"selected\""));
+
+    client.print(F(">"));
+    client.print(upload_rates[i]);
+    client.print(F(" </option>")); 
   }
-  client.print("</select>");
+  client.print(F("</select>"));
+  print_html_sep(client);
+
+  client.print(F("Upload format:&nbsp;"));
+  client.print(F("<select name=\"u_fmt\">"));
+  client.print(F("<option value=\"0\""));
+  if(upload_format == UPLOAD_JSON)
+    client.print(F(" selected=\"selected\""));
+  client.print(F(">JSON </option>"));
+  client.print(F("<option value=\"1\""));
+  if(upload_format == UPLOAD_PACKED)
+    client.print(F(" selected=\"selected\""));
+  client.print(F(">packed binary (" BATCH_CONTENT_TYPE "), HTTP only </option>"));
+  client.print(F("</select>"));
+  print_html_sep(client);
+
+  client.print(F("Between readings:&nbsp;"));
+  client.print(F("<select name=\"agg\">"));
+  client.print(F("<option value=\"0\""));
+  if(!aggregate)
+    client.print(F(" selected=\"selected\""));
+  client.print(F(">log the reading only </option>"));
+  client.print(F("<option value=\"1\""));
+  if(aggregate)
+    client.print(F(" selected=\"selected\""));
+  client.print(F(">sample continuously, log min/max/mean power </option>"));
+  client.print(F("</select>"));
+  print_html_sep(client);
+
+  client.print(F("Pre-allocate daily logs:&nbsp;"));
+  client.print(F("<select name=\"prealloc\">"));
+  client.print(F("<option value=\"0\""));
+  if(!prealloc)
+    client.print(F(" selected=\"selected\""));
+  client.print(F(">no, grow them as records are added </option>"));
+  client.print(F("<option value=\"1\""));
+  if(prealloc)
+    client.print(F(" selected=\"selected\""));
+  client.print(F(">yes, fill tomorrow's log in advance </option>"));
+  client.print(F("</select>"));
   print_html_sep(client);
  
-  print_html_input(client, "Database HOME ID", "H_id", 0, 4, home_id, NULL);
+  print_html_input(client, F("Database HOME ID"), "H_id", 0, 4, home_id, NULL);
   print_html_sep(client);
 
-  client.print("Configuration for meters to be read: ");
-  client.print("<blockquote><table border=\"1\"><tr><th> Meter Number </th><th> MODBUS ID </th><th> METER ID </th><th> METER TYPE </th></tr>");      
+  client.print(F("Configuration for meters to be read: "));
+  client.print(F("<blockquote><table border=\"1\"><tr><th> Meter Number </th><th> MODBUS ID </th><th> METER ID </th><th> METER TYPE </th><th> RS485 BUS </th></tr>"));      
   for(i = 0; i < MAX_METERS; i++)
   {
-    client.print("<tr><td align=\"center\"> #");
+    client.print(F("<tr><td align=\"center\"> #"));
     client.print(i+1);
-    client.print("</td><td align=\"center\">");
+    client.print(F("</td><td align=\"center\">"));
     
     num[0] = 0;
     if(modbus_id[i] > 0)
       String(modbus_id[i]).toCharArray(num, sizeof(num));
       
     print_html_input(client, NULL, "mbID", i+1, 3, num, NULL);
-    client.print("</td><td align=\"center\">");
+    client.print(F("</td><td align=\"center\">"));
     
     print_html_input(client, NULL, "mID", i+1, 4, meter_id[i], NULL);
-    client.print("</td><td align=\"center\">");
+    client.print(F("</td><td align=\"center\">"));
             
-    client.print("<select name=\"t");
+    client.print(F("<select name=\"t"));
     client.print(i+1);
-    client.print("\">");
-    for(int j = 0; j < sizeof(meter_types) / sizeof(char *); j++)
+    client.print(F("\">"));
+    for(int j = 0; j < MODEL_COUNT; j++)
     {
-      client.print("<option value=\"");
+      client.print(F("<option value=\""));
       client.print(j);
-      client.print("\"");
+      client.print(F("\""));
       
       if(meter_type[i] == j)
-        client.print(" selected=\"selected\"");
+        client.print(F(" selected=\"selected\""));
+      
+      client.print(F(">"));
+      client.print(meter_models[j].name);
+      client.print(F("</option>"));
+      
+    }
+    client.print(F("</select>"));
+    client.print(F("</td><td align=\"center\">"));
+
+    client.print(F("<select name=\"bus"));
+    client.print(i+1);
+    client.print(F("\">"));
+    for(int j = 0; j < MAX_BUSES; j++)
+    {
+      client.print(F("<option value=\""));
+      client.print(j);
+      client.print(F("\""));
       
-      client.print(">");
-      client.print(meter_types[j]);
-      client.print("</option>");
+      if(meter_bus[i] == j)
+        client.print(F(" selected=\"selected\""));
       
+      client.print(F(">"));
+      client.print(j+1);
+      client.print(F(" (Serial"));
+      client.print(bus_ports[j]);
+      client.print(F(")</option>"));
     }
-    client.print("</select>");
-    client.print("</td></tr>");        
+    client.print(F("</select>"));
+    client.print(F("</td></tr>"));        
   }
-  client.print("</table></blockquote>");
+  client.print(F("</table></blockquote>"));
   print_html_sep(client);
 
-  client.print("<input type=\"submit\" value=\"Save Settings\"/>");
-  client.print("<hr/>");
-  client.print("</form></body></html>");
+  // the POST parser acts on a field when it sees the '&' after it, this
+  // keeps the last real field from being dropped
+  client.print(F("<input type=\"hidden\" name=\"end\" value=\"1\"/>"));
+  client.print(F("<input type=\"submit\" value=\"Save Settings\"/>"));
+  client.print(F("<hr/>"));
+  client.print(F("</form></body></html>"));
 }
 
 void send_dirinfo(EthernetClient client)
@@ -673,17 +3063,455 @@ long print_dir(File dir, int numTabs, char *root, EthernetClient client)
   return fsize;
 }
 
+// Modbus transaction counters per meter, one JSON object per line
+void send_modbus_stats(EthernetClient client)
+{
+  client.println(F("HTTP/1.1 200 OK"));
+  client.println(F("Content-Type: text/plain"));
+  client.println();
+
+  for(int i = 0; i < meter_count; i++)
+  {
+    ModbusStats *st = &mb_stats[i];
+    byte model = (meter_type[i] < MODEL_COUNT) ? meter_type[i] : 0;
+    
+    client.print(F("{\"meter\": \""));
+    client.print(meter_id[i]);
+    client.print(F("\", \"bus\": "));
+    client.print(meter_bus[i] + 1);
+    client.print(F(", \"slave\": "));
+    client.print(modbus_id[i]);
+    client.print(F(", \"requests\": "));
+    client.print(st->Requests);
+    
+    // histogram keys are the bucket upper bounds in ms
+    client.print(F(", \"latency\": {"));
+    for(int b = 0; b < MB_LATENCY_BUCKETS; b++)
+    {
+      word limit = ModbusMaster::latencyBucketLimit(b);
+      
+      if(limit)
+      {
+        client.print(F("\"<"));
+        client.print(limit);
+      }
+      else
+      {
+        client.print(F("\">="));
+        client.print(ModbusMaster::latencyBucketLimit(b - 1));
+      }
+      client.print(F("\": "));
+      client.print(st->Latency[b]);
+      if(b < MB_LATENCY_BUCKETS - 1)
+        client.print(F(", "));
+    }
+    
+    client.print(F("}, \"timeouts\": "));
+    client.print(st->Timeouts);
+    client.print(F(", \"crc_errors\": "));
+    client.print(st->CRCErrors);
+    client.print(F(", \"slave_id_errors\": "));
+    client.print(st->SlaveIDErrors);
+    client.print(F(", \"function_errors\": "));
+    client.print(st->FunctionErrors);
+    
+    // exception codes 1 to 4, then any other
+    client.print(F(", \"exceptions\": ["));
+    for(int e = 0; e < 5; e++)
+    {
+      client.print(st->Exceptions[e]);
+      if(e < 4)
+        client.print(F(", "));
+    }
+    
+    client.print(F("], \"bytes_sent\": "));
+    client.print(st->BytesSent);
+    client.print(F(", \"bytes_received\": "));
+    client.print(st->BytesReceived);
+    client.print(F(", \"srtt\": "));
+    client.print(mb_srtt[i] / 8);
+    client.print(F(", \"timeout\": "));
+    client.print(meter_timeout(i, read_plan[plan_first[model]].count)); // for its first read
+    client.print(F("},\r\n"));
+  }
+}
+
+// Bytes left between the top of the heap and the stack
+int free_ram()
+{
+  extern char __heap_start, *__brkval;
+  char top;
+  
+  return &top - (__brkval ? __brkval : &__heap_start);
+}
+
+// How well the sampling schedule is being kept, and the RAM left to keep it
+void send_sampler_stats(EthernetClient client)
+{
+  client.println(F("HTTP/1.1 200 OK"));
+  client.println(F("Content-Type: text/plain"));
+  client.println();
+
+  client.print(F("{\"period_ms\": "));
+  client.print(read_periods[read_rate]);
+  client.print(F(", \"samples\": "));
+  client.print(sample_count);
+  client.print(F(", \"overruns\": "));
+  client.print(sample_overruns);
+  client.print(F(", \"late_max_ms\": "));
+  client.print(sample_late_max);
+  client.print(F(", \"free_ram\": "));
+  client.print(free_ram());
+  client.print(F("}\r\n"));
+}
+
+// Copy the value of name=... in a request line's query string to val,
+// returns false if it is not there
+boolean query_param(char *line, char *name, char *val, byte len)
+{
+  char *p = strchr(line, '?');
+  byte n = strlen(name);
+  
+  while(p)
+  {
+    p++;
+    if(!strncmp(p, name, n) && p[n] == '=')
+    {
+      byte i = 0;
+      
+      // browsers send a time's colons as %3A
+      for(p += n + 1; *p && *p != '&' && *p != ' ' && i < len - 1; p++)
+      {
+        if(*p == '%' && isxdigit(p[1]) && isxdigit(p[2]))
+        {
+          char hex[3] = { p[1], p[2], 0 };
+          
+          val[i++] = strtol(hex, NULL, 16);
+          p += 2;
+        }
+        else if(*p == '+')
+          val[i++] = ' ';
+        else
+          val[i++] = *p;
+      }
+      val[i] = 0;
+      return true;
+    }
+    p = strchr(p, '&');
+  }
+  
+  return false;
+}
+
+// A time given as seconds since 1970, as YYYY-MM-DDTHH:MM:SS (UTC) or as
+// YYYY-MM-DD for its midnight, 0 if it is none of them. A time cut short,
+// or with anything after it, is not taken for an earlier one.
+time_t parse_time(char *val)
+{
+  tmElements_t tm;
+  int y, mo, d, h = 0, mi = 0, sec = 0;
+  int fields, end = 0;
+  char *rest;
+  
+  if(!strchr(val, '-'))
+  {
+    unsigned long secs = strtoul(val, &rest, 10);
+    
+    return (rest != val && !*rest) ? secs : 0;
+  }
+  
+  fields = sscanf(val, "%d-%d-%d%n", &y, &mo, &d, &end);
+  if(fields == 3 && val[end])
+  {
+    end = 0;
+    fields = sscanf(val, "%d-%d-%dT%d:%d:%d%n", &y, &mo, &d, &h, &mi, &sec, &end);
+    if(fields != 6)
+      return 0;
+  }
+  if(fields < 3 || val[end] || y < 1970)
+    return 0;
+  tm.Year = CalendarYrToTm(y);
+  tm.Month = mo;
+  tm.Day = d;
+  tm.Hour = h;
+  tm.Minute = mi;
+  tm.Second = sec;
+  return makeTime(tm);
+}
+
+// GET /range?meter=..&from=..&to=..: the logged readings of one meter, or
+// of all without meter=, from the daily logs. to defaults to now. Only the
+// headers go out here, send_range_step() sends the days one per pass of 
+// loop() so sampling is not held up; returns true if it is to be called.
+boolean send_range(EthernetClient client, char *line)
+{
+  char val[24];
+  time_t from = 0, to = now();
+  
+  if(query_param(line, "from", val, sizeof(val)))
+    from = parse_time(val);
+  if(query_param(line, "to", val, sizeof(val)))
+    to = parse_time(val);
+  range_meter[0] = 0;
+  query_param(line, "meter", range_meter, sizeof(range_meter));
+  
+  if(!from || to < from || elapsedDays(to) - elapsedDays(from) >= RANGE_MAX_DAYS)
+  {
+    client.println("HTTP/1.1 400 Bad Request");
+    client.println("Content-Type: text/plain");
+    client.println();
+    client.print("Need from= and to= no more than ");
+    client.print(RANGE_MAX_DAYS);
+    client.println(" days apart");
+    return false;
+  }
+  
+  // today's latest records may still be in RAM
+  flush_logs();
+  
+  client.println("HTTP/1.1 200 OK");
+  client.println("Content-Type: text/plain");
+  client.println();
+  
+  range_client = client;
+  range_day = elapsedDays(from);
+  range_last = elapsedDays(to);
+  range_from_ms = elapsedSecsToday(from) * 1000UL;
+  range_to_ms = elapsedSecsToday(to) * 1000UL + 999;
+  range_open = true;
+  return true;
+}
+
+// The next day of the /range reply send_range() started, the connection 
+// is closed after the last one or if the client has gone
+void send_range_step()
+{
+  time_t midnight = range_day * SECS_PER_DAY;
+  char name[32];
+  uint8_t buf[256];
+  PrintBuffer out(range_client, buf, sizeof(buf));
+  
+  if(range_client.connected())
+  {
+    sprintf(name, "%04d/%02d/%02d.bin", year(midnight), month(midnight), day(midnight));
+    send_range_day(out, name, range_meter, range_from_ms,
+                   range_day == range_last ? range_to_ms : 0xFFFFFFFFUL);
+    out.flush();
+    range_from_ms = 0;
+    
+    if(range_day++ != range_last)
+      return;
+  }
+  
+  range_open = false;
+  delay(1);
+  range_client.stop();
+}
+
+// The readings in one daily log from from_ms to to_ms into the day. The 
+// index gives the last record logged at or before from_ms and the header it
+// follows, the search goes on from there.
+void send_range_day(Print &out, char *name, char *meter, unsigned long from_ms, unsigned long to_ms)
+{
+  log_header h;
+  log_meter meters[MAX_METERS];
+  log_index entry;
+  boolean have_header = false;
+  char idx_name[32];
+  File fp, idx;
+  int tag;
+  
+  if(!(fp = SD.open(name, FILE_READ)))
+    return;
+  
+  index_name(idx_name, name);
+  if(idx = SD.open(idx_name, FILE_READ))
+  {
+    // binary search, the entries are in time order
+    unsigned long lo = 0, hi = idx.size() / sizeof(log_index);
+    boolean found = false;
+    
+    while(lo < hi)
+    {
+      unsigned long mid = (lo + hi) / 2;
+      log_index e;
+      
+      idx.seek(mid * sizeof(log_index));
+      idx.read(&e, sizeof(e));
+      if(e.ms <= from_ms)
+      {
+        entry = e;
+        found = true;
+        lo = mid + 1;
+      }
+      else
+        hi = mid;
+    }
+    idx.close();
+    
+    if(found && entry.record < fp.size())
+    {
+      fp.seek(entry.header);
+      have_header = fp.read() == LOG_TAG_HEADER && read_log_header(fp, h, meters);
+      fp.seek(have_header ? entry.record : 0);
+    }
+  }
+  
+  while((tag = fp.read()) >= 0)
+  {
+    if(tag == LOG_TAG_HEADER)
+    {
+      if(!(have_header = read_log_header(fp, h, meters)))
+        break;
+    }
+    else if(tag == LOG_TAG_RECORD && have_header)
+    {
+      log_record r;
+      unsigned long start = fp.position() - 1;
+      
+      if(fp.read((uint8_t *)&r + 1, sizeof(r) - 1) != sizeof(r) - 1 || r.ms > to_ms ||
+         !log_record_whole(fp, start, h))
+        break;
+      if(r.ms < from_ms)
+      {
+        // not there yet, skip the values unread
+        fp.seek(start + log_record_size(h));
+        continue;
+      }
+      
+      byte ts_len = format_timestamp(h.base_time + r.ms / 1000, r.ms % 1000, h.period_ms < 1000);
+      
+      for(int i = 0; i < h.meter_count; i++)
+      {
+        float values[MAX_MEASURES];
+        log_aggregate agg;
+        char id[5];
+        
+        if(fp.read(values, sizeof(values)) != sizeof(values) ||
+           ((h.flags & LOG_FLAG_AGGREGATE) && fp.read(&agg, sizeof(agg)) != sizeof(agg)))
+          break;
+        
+        memcpy(id, meters[i].id, 4);
+        id[4] = 0;
+        if(!meter[0] || !strcmp(meter, id))
+          print_reading(out, id, ts_len, values, (h.flags & LOG_FLAG_AGGREGATE) ? &agg : NULL);
+      }
+      fp.seek(start + log_record_size(h));
+    }
+    else
+      break;
+  }
+  
+  fp.close();
+}
+
+// The rest of a daily log header after its tag, false if it is not one this
+// firmware can read
+boolean read_log_header(File &fp, log_header &h, log_meter *meters)
+{
+  int len;
+  
+  if(fp.read((uint8_t *)&h + 1, sizeof(h) - 1) != (int)sizeof(h) - 1 ||
+     memcmp(h.magic, LOG_MAGIC, sizeof(h.magic)) || h.version != LOG_VERSION ||
+     h.meter_count > MAX_METERS || h.measure_count != MAX_MEASURES)
+    return false;
+  
+  len = h.meter_count * sizeof(log_meter);
+  return fp.read(meters, len) == len;
+}
+
+// How the uplink connections are being used
+void send_uplink_stats(EthernetClient client)
+{
+  client.println(F("HTTP/1.1 200 OK"));
+  client.println(F("Content-Type: text/plain"));
+  client.println();
+
+  client.print(F("{\"posts\": "));
+  client.print(ws_posts);
+  client.print(F(", \"connects\": "));
+  client.print(ws_connects);
+  client.print(F(", \"reused\": "));
+  client.print(ws_reuses);
+  client.print(F(", \"dns_lookups\": "));
+  client.print(ws_lookups);
+  client.print(F(", \"failures\": "));
+  client.print(ws_failures);
+  client.print(F(", \"last_ms\": "));
+  client.print(ws_last_ms);
+  client.print(F(", \"max_ms\": "));
+  client.print(ws_max_ms);
+  client.print(F(", \"uplink\": \""));
+  client.print(uplink == UPLINK_MQTT ? F("mqtt") : F("http"));
+  client.print(F("\", \"publishes\": "));
+  client.print(ws_publishes);
+  client.print(F(", \"pubacks\": "));
+  client.print(ws_pubacks);
+  client.print(F(", \"format\": \""));
+  client.print(upload_format == UPLOAD_PACKED ? F("packed") : F("json"));
+  client.print(F("\", \"body_bytes\": "));
+  client.print(ws_bytes);
+  client.print(F("}\r\n"));
+}
+
+// Daily log write latency and how far the pre-allocation has got
+void send_sd_stats(EthernetClient client)
+{
+  client.println(F("HTTP/1.1 200 OK"));
+  client.println(F("Content-Type: text/plain"));
+  client.println();
+
+  client.print(F("{\"prealloc\": "));
+  client.print(prealloc ? 1 : 0);
+  client.print(F(", \"prealloc_bytes\": "));
+  client.print(pre_fp ? pre_fp.size() : 0);
+  client.print(F(", \"prealloc_target\": "));
+  client.print(log_day_size());
+  client.print(F(", \"writes\": "));
+  client.print(sd_writes);
+  client.print(F(", \"write_max_ms\": "));
+  client.print(sd_write_max);
+  
+  // histogram keys are the bucket upper bounds in ms
+  client.print(F(", \"latency\": {"));
+  for(int b = 0; b < SD_LATENCY_BUCKETS; b++)
+  {
+    if(b < SD_LATENCY_BUCKETS - 1)
+    {
+      client.print(F("\"<"));
+      client.print(4UL << b);
+    }
+    else
+    {
+      client.print(F("\">="));
+      client.print(4UL << (b - 1));
+    }
+    client.print(F("\": "));
+    client.print(sd_latency[b]);
+    if(b < SD_LATENCY_BUCKETS - 1)
+      client.print(F(", "));
+  }
+  client.print(F("}}\r\n"));
+}
+
 // Send JSON text to browser/computer that has made a request
 void handle_web_requests()
 {
+  // a /range reply is finished before the next request is taken
+  if(range_open)
+  {
+    send_range_step();
+    return;
+  }
+  
   EthernetClient client = server.available();
-  char line[81];
+  char line[129]; // long enough for a /range query
   int i;
 
   if(client) 
   {
     // read in first line only to get method and url requested
-    for(i = 0; i < 81; i++)
+    for(i = 0; i < (int)sizeof(line) - 2; i++)
     {
       if(!client.connected())
         return;
@@ -725,7 +3553,7 @@ void handle_web_requests()
     }    
     else if(strstr(line, "GET /unsent ") != 0)
     {
-      if(!send_file(sd_unsent, client))
+      if(!send_unsent(client))
       {
         client.println("HTTP/1.1 200 OK");
         client.println("Content-Type: text/plain");
@@ -733,6 +3561,28 @@ void handle_web_requests()
         client.println("No unsent data.");
       }
     }
+    else if(strstr(line, "GET /stats/modbus ") != 0)
+    {
+      send_modbus_stats(client);
+    }
+    else if(strstr(line, "GET /stats/sampler ") != 0)
+    {
+      send_sampler_stats(client);
+    }
+    else if(strstr(line, "GET /stats/uplink ") != 0)
+    {
+      send_uplink_stats(client);
+    }
+    else if(strstr(line, "GET /stats/sd ") != 0)
+    {
+      send_sd_stats(client);
+    }
+    else if(strstr(line, "GET /range?") != 0)
+    {
+      // left open for send_range_step()
+      if(send_range(client, line))
+        return;
+    }
     else if(strstr(line, "GET /files ") != 0)
     {
       send_dirinfo(client);
@@ -935,6 +3785,33 @@ void write_settings(EthernetClient client)
         write_eeprom("mID16", var, ITYPE_STR, val, 218, 4);
         write_eeprom("t16", var, ITYPE_INT, val, 222, 1);
 
+        write_eeprom("bus1", var, ITYPE_INT, val, 223, 1);
+        write_eeprom("bus2", var, ITYPE_INT, val, 224, 1);
+        write_eeprom("bus3", var, ITYPE_INT, val, 225, 1);
+        write_eeprom("bus4", var, ITYPE_INT, val, 226, 1);
+        write_eeprom("bus5", var, ITYPE_INT, val, 227, 1);
+        write_eeprom("bus6", var, ITYPE_INT, val, 228, 1);
+        write_eeprom("bus7", var, ITYPE_INT, val, 229, 1);
+        write_eeprom("bus8", var, ITYPE_INT, val, 230, 1);
+        write_eeprom("bus9", var, ITYPE_INT, val, 231, 1);
+        write_eeprom("bus10", var, ITYPE_INT, val, 232, 1);
+        write_eeprom("bus11", var, ITYPE_INT, val, 233, 1);
+        write_eeprom("bus12", var, ITYPE_INT, val, 234, 1);
+        write_eeprom("bus13", var, ITYPE_INT, val, 235, 1);
+        write_eeprom("bus14", var, ITYPE_INT, val, 236, 1);
+        write_eeprom("bus15", var, ITYPE_INT, val, 237, 1);
+        write_eeprom("bus16", var, ITYPE_INT, val, 238, 1);
+        
+        write_eeprom("agg", var, ITYPE_INT, val, 239, 1);
+        
+        write_eeprom("prealloc", var, ITYPE_INT, val, 240, 1);
+        
+        write_eeprom("u_rate", var, ITYPE_INT, val, 241, 1);
+        
+        write_eeprom("u_fmt", var, ITYPE_INT, val, 242, 1);
+        
+        write_eeprom("uplink", var, ITYPE_INT, val, 243, 1);
+
         counter = 0;
         Serial.print(".");
       } 
@@ -958,6 +3835,16 @@ void write_settings(EthernetClient client)
 
 void software_reset()
 {
+  // jumping to 0 does not close anything, records still in log_buf and the
+  // sizes of files grown since their last flush would be lost
+  flush_logs();
+  log_fp.close();
+  idx_fp.close();
+  pre_fp.close();
+  unsent_fp.close();
+  cursor_fp.close();
+  up_fp.close();
+  
   Serial.println("Arduino will now reset...");
   delay(500);
   asm volatile ("  jmp 0");  
@@ -1009,11 +3896,28 @@ void read_settings()
     rs485_baud_rate = eeprom_read(121);
     
     read_rate = eeprom_read(122);
+    if(read_rate >= READ_RATE_COUNT)
+      read_rate = 3;
      
     for(i=0 ; i<sizeof(home_id)-1; i++)
     {
       home_id[i] = eeprom_read(123+i);
     }
+    
+    aggregate = (eeprom_read(239) == 1);
+    
+    prealloc = (eeprom_read(240) == 1);
+    
+    upload_rate = eeprom_read(241);
+    if(upload_rate >= UPLOAD_RATE_COUNT)
+      upload_rate = 0;
+    
+    upload_format = (eeprom_read(242) == 1) ? UPLOAD_PACKED : UPLOAD_JSON;
+    
+    // MQTT carries the JSON lines, a message each
+    uplink = (eeprom_read(243) == 1) ? UPLINK_MQTT : UPLINK_HTTP;
+    if(uplink == UPLINK_MQTT)
+      upload_format = UPLOAD_JSON;
  
     meter_count = 0;
     int rowsize = 6;
@@ -1027,6 +3931,9 @@ void read_settings()
           meter_id[j][i] = eeprom_read(128+(rowsize*j)+i);
         }
         meter_type[j] = eeprom_read(132+(rowsize*j));
+        meter_bus[j] = eeprom_read(223+j);
+        if(meter_bus[j] >= MAX_BUSES)
+          meter_bus[j] = 0;
 
         meter_count++;
       }
@@ -83,6 +83,16 @@ void DS1307RTC::write(tmElements_t &tm)
 
   Wire.endTransmission();  
 }
+// Set up the SQW/OUT pin, e.g. DS1307_SQW_1HZ for a once a second interrupt.
+// SQW/OUT is open drain and needs a pull-up.
+void DS1307RTC::squareWave(uint8_t control)
+{
+  Wire.beginTransmission(DS1307_CTRL_ID);
+  Wire.write(0x07); // control register
+  Wire.write(control);
+  Wire.endTransmission();
+}
+
 // PRIVATE FUNCTIONS
 
 // Convert Decimal to Binary Coded Decimal (BCD)
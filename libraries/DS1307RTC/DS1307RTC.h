@@ -8,6 +8,10 @@
 
 #include <Time.h>
 
+// values for squareWave(), the DS1307 control register
+#define DS1307_SQW_OFF  0x00
+#define DS1307_SQW_1HZ  0x10  // SQWE set, RS1:RS0 = 00; the falling edge starts each second
+
 // library interface description
 class DS1307RTC
 {
@@ -18,6 +22,7 @@ class DS1307RTC
 	static void set(time_t t);
 	static void read(tmElements_t &tm);
 	static void write(tmElements_t &tm);
+	static void squareWave(uint8_t control);
 
   private:
 	static uint8_t dec2bcd(uint8_t num);
@@ -20,58 +20,178 @@
 
 #include "ModbusMaster.h"
 
-HardwareSerial MBSerial = Serial; ///< Pointer to Serial class object
-
 
 ModbusMaster::ModbusMaster(void)
 {
+	_Transport = &_RTU;
+	_State = MBStateIdle;
+	_Status = MBSuccess;
+	_Transaction = 0;
+	_Dest = 0;
+	_Stats = 0;
+	_ResponseTimeout = MBResponseTimeout;
+	_Latency = 0;
+	_ResponseBuffer = 0;
+	_ResponseBufferSize = 0;
+	_TransmitBuffer = 0;
+	_TransmitBufferSize = 0;
 }
 
-void ModbusMaster::begin(uint16_t BaudRate)
+void ModbusMaster::begin(uint32_t BaudRate)
 {
 	begin(0, BaudRate);
 }
 
-void ModbusMaster::begin(uint8_t SerialPort, uint16_t BaudRate)
+/**
+ Talk Modbus RTU on one of the serial ports.
+ 
+ @param SerialPort 0 for Serial, 1..3 for Serial1..Serial3 on a Mega
+ @param BaudRate line speed
+ */
+void ModbusMaster::begin(uint8_t SerialPort, uint32_t BaudRate)
 {
+	HardwareSerial *Port;
+	
 	switch(SerialPort)
 	{
 #if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
 		case 1:
-			MBSerial = Serial1;
+			Port = &Serial1;
 			break;
 			
 		case 2:
-			MBSerial = Serial2;
+			Port = &Serial2;
 			break;
 			
 		case 3:
-			MBSerial = Serial3;
+			Port = &Serial3;
 			break;
 #endif
 			
 		case 0:
 		default:
-			MBSerial = Serial;
+			Port = &Serial;
 			break;
 	}
 	
-	MBSerial.begin(BaudRate);
+	_RTU.begin(*Port, BaudRate);
+	begin(_RTU);
+}
+
+/**
+ Talk Modbus over some other transport, e.g. a ModbusTCPTransport.
+ 
+ The transport must outlive this object. Several masters may share one 
+ transport if it allows more than one transaction at a time.
+ 
+ @param Transport transport the requests go out on
+ */
+void ModbusMaster::begin(ModbusTransport &Transport)
+{
+	_Transport = &Transport;
+	clearTransmitBuffer();
+}
+
+/**
+ Set how long to wait for a reply before giving up.
+ 
+ Lets the caller shorten the wait for a slave whose response time is 
+ known, instead of always waiting the worst case.
+ 
+ @param Timeout response timeout in milliseconds (1..MBResponseTimeout)
+ */
+void ModbusMaster::setResponseTimeout(uint16_t Timeout)
+{
+	_ResponseTimeout = constrain(Timeout, 1, MBResponseTimeout);
+}
+
+/**
+ Round trip time of the last successful transaction.
+ 
+ @return milliseconds from sending the request to receiving the last byte 
+ of the reply
+ */
+uint16_t ModbusMaster::lastLatency()
+{
+	return _Latency;
+}
+
+/**
+ Count the following transactions into Stats.
+ 
+ One ModbusMaster often talks to several slaves; attach each slave's 
+ counters before starting a transaction with it.
+ 
+ @param Stats counters to add to, or 0 to stop counting
+ */
+void ModbusMaster::setStats(ModbusStats *Stats)
+{
+	_Stats = Stats;
+}
+
+/**
+ Upper bound of a ModbusStats latency bucket.
+ 
+ @param Bucket index into ModbusStats::Latency
+ @return round trip times in the bucket are below this many ms; 0 for 
+ the last, open ended bucket
+ */
+uint16_t ModbusMaster::latencyBucketLimit(uint8_t Bucket)
+{
+	if (Bucket >= MB_LATENCY_BUCKETS - 1)
+	{
+		return 0;
+	}
 	
+	return 4 << Bucket;
+}
+
+/**
+ Give the untyped reads somewhere to put the data they read.
+ 
+ Without one their data is dropped; typed reads never need it. A buffer 
+ of 64 words holds the longest response.
+ 
+ @param Buffer words for getResponseBuffer() to return, 0 for none
+ @param Size number of words in Buffer
+ @ingroup buffer
+ */
+void ModbusMaster::attachResponseBuffer(uint16_t *Buffer, uint8_t Size)
+{
+	_ResponseBuffer = Buffer;
+	_ResponseBufferSize = Buffer ? Size : 0;
+	clearResponseBuffer();
+}
+
+/**
+ Give the multiple writes somewhere to take the data they write from.
+ 
+ Without one only the single coil, single register and mask writes work.
+ 
+ @param Buffer words for setTransmitBuffer() to fill, 0 for none
+ @param Size number of words in Buffer
+ @ingroup buffer
+ */
+void ModbusMaster::attachTransmitBuffer(uint16_t *Buffer, uint8_t Size)
+{
+	_TransmitBuffer = Buffer;
+	_TransmitBufferSize = Buffer ? Size : 0;
 	clearTransmitBuffer();
 }
 
 /**
  Retrieve data from response buffer.
  
+ @see ModbusMaster::attachResponseBuffer()
  @see ModbusMaster::clearResponseBuffer()
- @param Index index of response buffer array (0x00..0x3F)
- @return value in position Index of response buffer (0x0000..0xFFFF)
+ @param Index index of response buffer array
+ @return value in position Index of response buffer (0x0000..0xFFFF); 
+ 0xFFFF past its end
  @ingroup buffer
  */
 uint16_t ModbusMaster::getResponseBuffer(uint8_t Index)
 {
-	if (Index < MaxBufferSize)
+	if (Index < _ResponseBufferSize)
 	{
 		return _ResponseBuffer[Index];
 	}
@@ -91,7 +211,7 @@ void ModbusMaster::clearResponseBuffer()
 {
 	uint8_t i;
 	
-	for (i = 0; i < MaxBufferSize; i++)
+	for (i = 0; i < _ResponseBufferSize; i++)
 	{
 		_ResponseBuffer[i] = 0;
 	}
@@ -100,15 +220,16 @@ void ModbusMaster::clearResponseBuffer()
 /**
  Place data in transmit buffer.
  
+ @see ModbusMaster::attachTransmitBuffer()
  @see ModbusMaster::clearTransmitBuffer()
- @param Index index of transmit buffer array (0x00..0x3F)
+ @param Index index of transmit buffer array
  @param Value value to place in position Index of transmit buffer (0x0000..0xFFFF)
  @return 0 on success; exception number on failure
  @ingroup buffer
  */
 uint8_t ModbusMaster::setTransmitBuffer(uint8_t Index, uint16_t Value)
 {
-	if (Index < MaxBufferSize)
+	if (Index < _TransmitBufferSize)
 	{
 		_TransmitBuffer[Index] = Value;
 		return MBSuccess;
@@ -129,7 +250,7 @@ void ModbusMaster::clearTransmitBuffer()
 {
 	uint8_t i;
 	
-	for (i = 0; i < MaxBufferSize; i++)
+	for (i = 0; i < _TransmitBufferSize; i++)
 	{
 		_TransmitBuffer[i] = 0;
 	}
@@ -281,8 +402,7 @@ uint8_t ModbusMaster::writeSingleRegister(uint8_t MBSlave, uint16_t WriteAddress
 										  uint16_t WriteValue)
 {
 	_WriteAddress = WriteAddress;
-	_WriteQty = 0;
-	_TransmitBuffer[0] = WriteValue;
+	_WriteQty = WriteValue;
 	return ModbusMasterTransaction(MBSlave, MBWriteSingleRegister);
 }
 
@@ -305,6 +425,11 @@ uint8_t ModbusMaster::writeSingleRegister(uint8_t MBSlave, uint16_t WriteAddress
 uint8_t ModbusMaster::writeMultipleCoils(uint8_t MBSlave, uint16_t WriteAddress,
 										 uint16_t BitQty)
 {
+	if (BitQty > 16 * _TransmitBufferSize)
+	{
+		return MBIllegalDataAddress;
+	}
+	
 	_WriteAddress = WriteAddress;
 	_WriteQty = BitQty;
 	return ModbusMasterTransaction(MBSlave, MBWriteMultipleCoils);
@@ -327,6 +452,11 @@ uint8_t ModbusMaster::writeMultipleCoils(uint8_t MBSlave, uint16_t WriteAddress,
 uint8_t ModbusMaster::writeMultipleRegisters(uint8_t MBSlave, uint16_t WriteAddress,
 											 uint16_t WriteQty)
 {
+	if (WriteQty > _TransmitBufferSize)
+	{
+		return MBIllegalDataAddress;
+	}
+	
 	_WriteAddress = WriteAddress;
 	_WriteQty = WriteQty;
 	return ModbusMasterTransaction(MBSlave, MBWriteMultipleRegisters);
@@ -357,9 +487,10 @@ uint8_t ModbusMaster::writeMultipleRegisters(uint8_t MBSlave, uint16_t WriteAddr
 uint8_t ModbusMaster::maskWriteRegister(uint8_t MBSlave, uint16_t WriteAddress,
 										uint16_t AndMask, uint16_t OrMask)
 {
+	// the masks travel in the quantities, which this function has no use for
 	_WriteAddress = WriteAddress;
-	_TransmitBuffer[0] = AndMask;
-	_TransmitBuffer[1] = OrMask;
+	_WriteQty = AndMask;
+	_ReadQty = OrMask;
 	return ModbusMasterTransaction(MBSlave, MBMaskWriteRegister);
 }
 
@@ -386,6 +517,11 @@ uint8_t ModbusMaster::maskWriteRegister(uint8_t MBSlave, uint16_t WriteAddress,
 uint8_t ModbusMaster::readWriteMultipleRegisters(uint8_t MBSlave, uint16_t ReadAddress,
 												 uint16_t ReadQty, uint16_t WriteAddress, uint16_t WriteQty)
 {
+	if (WriteQty > _TransmitBufferSize)
+	{
+		return MBIllegalDataAddress;
+	}
+	
 	_ReadAddress = ReadAddress;
 	_ReadQty = ReadQty;
 	_WriteAddress = WriteAddress;
@@ -394,37 +530,371 @@ uint8_t ModbusMaster::readWriteMultipleRegisters(uint8_t MBSlave, uint16_t ReadA
 }
 
 /**
- Modbus transaction engine.
- Sequence:
- - assemble Modbus Request Application Data Unit (ADU),
- based on particular function called
- - transmit request over selected serial port
- - wait for/retrieve response
- - evaluate/disassemble response
- - return status (success/exception)
+ Start a Modbus function 0x01 Read Coils without waiting for the reply.
+ 
+ The transaction is driven by calling poll() until it no longer returns 
+ MBBusy; the coils are then available through getResponseBuffer().
+ 
+ @see ModbusMaster::readCoils()
+ @see ModbusMaster::poll()
+ @return 0 if the request was sent; MBBusy if a transaction is in progress 
+ or the inter-frame gap has not passed yet, try again later
+ @ingroup discrete
+ */
+uint8_t ModbusMaster::startReadCoils(uint8_t MBSlave, uint16_t ReadAddress, uint16_t BitQty)
+{
+	if (_State != MBStateIdle)
+	{
+		return MBBusy;
+	}
+	
+	_ReadAddress = ReadAddress;
+	_ReadQty = BitQty;
+	_Dest = 0;
+	return startTransaction(MBSlave, MBReadCoils);
+}
+
+/**
+ Start a Modbus function 0x02 Read Discrete Inputs without waiting for 
+ the reply.
+ 
+ @see ModbusMaster::readDiscreteInputs()
+ @see ModbusMaster::poll()
+ @return 0 if the request was sent; MBBusy if a transaction is in progress 
+ or the inter-frame gap has not passed yet, try again later
+ @ingroup discrete
+ */
+uint8_t ModbusMaster::startReadDiscreteInputs(uint8_t MBSlave, uint16_t ReadAddress,
+											  uint16_t BitQty)
+{
+	if (_State != MBStateIdle)
+	{
+		return MBBusy;
+	}
+	
+	_ReadAddress = ReadAddress;
+	_ReadQty = BitQty;
+	_Dest = 0;
+	return startTransaction(MBSlave, MBReadDiscreteInputs);
+}
+
+/**
+ Start a Modbus function 0x03 Read Holding Registers without waiting for 
+ the reply.
+ 
+ @see ModbusMaster::readHoldingRegisters()
+ @see ModbusMaster::poll()
+ @return 0 if the request was sent; MBBusy if a transaction is in progress 
+ or the inter-frame gap has not passed yet, try again later
+ @ingroup register
+ */
+uint8_t ModbusMaster::startReadHoldingRegisters(uint8_t MBSlave, uint16_t ReadAddress,
+												uint16_t ReadQty)
+{
+	if (_State != MBStateIdle)
+	{
+		return MBBusy;
+	}
+	
+	_ReadAddress = ReadAddress;
+	_ReadQty = ReadQty;
+	_Dest = 0;
+	return startTransaction(MBSlave, MBReadHoldingRegisters);
+}
+
+/**
+ Start a Modbus function 0x04 Read Input Registers without waiting for 
+ the reply.
+ 
+ @see ModbusMaster::readInputRegisters()
+ @see ModbusMaster::poll()
+ @return 0 if the request was sent; MBBusy if a transaction is in progress 
+ or the inter-frame gap has not passed yet, try again later
+ @ingroup register
+ */
+uint8_t ModbusMaster::startReadInputRegisters(uint8_t MBSlave, uint16_t ReadAddress,
+											  uint8_t ReadQty)
+{
+	if (_State != MBStateIdle)
+	{
+		return MBBusy;
+	}
+	
+	_ReadAddress = ReadAddress;
+	_ReadQty = ReadQty;
+	_Dest = 0;
+	return startTransaction(MBSlave, MBReadInputRegisters);
+}
+
+/**
+ Start a typed Modbus function 0x03 Read Holding Registers.
+ 
+ Rather than going through the response buffer, each value listed in 
+ Fields is written straight from the received frame into the caller's 
+ struct at Dest as a native u16, s16, u32, s32 or float. Dest must stay 
+ valid until poll() stops returning MBBusy, and is only meaningful if the 
+ transaction succeeded.
+ 
+ @param ReadAddress address of the first holding register (0x0000..0xFFFF)
+ @param ReadQty quantity of holding registers to read (1..125, enforced by remote device)
+ @param Fields values to decode, their Register relative to ReadAddress
+ @param FieldCount number of entries in Fields
+ @param Dest struct the values are written into
+ @return 0 if the request was sent; MBBusy if a transaction is in progress 
+ or the inter-frame gap has not passed yet, try again later
+ @ingroup register
+ */
+uint8_t ModbusMaster::startReadHoldingRegisters(uint8_t MBSlave, uint16_t ReadAddress,
+												uint16_t ReadQty, const ModbusField *Fields,
+												uint8_t FieldCount, void *Dest)
+{
+	if (_State != MBStateIdle)
+	{
+		return MBBusy;
+	}
+	
+	_ReadAddress = ReadAddress;
+	_ReadQty = ReadQty;
+	_Fields = Fields;
+	_FieldCount = FieldCount;
+	_Dest = (uint8_t *)Dest;
+	return startTransaction(MBSlave, MBReadHoldingRegisters);
+}
+
+/**
+ Start a typed Modbus function 0x04 Read Input Registers.
+ 
+ @see ModbusMaster::startReadHoldingRegisters(uint8_t, uint16_t, uint16_t, const ModbusField *, uint8_t, void *)
+ @return 0 if the request was sent; MBBusy if a transaction is in progress 
+ or the inter-frame gap has not passed yet, try again later
+ @ingroup register
+ */
+uint8_t ModbusMaster::startReadInputRegisters(uint8_t MBSlave, uint16_t ReadAddress,
+											  uint8_t ReadQty, const ModbusField *Fields,
+											  uint8_t FieldCount, void *Dest)
+{
+	if (_State != MBStateIdle)
+	{
+		return MBBusy;
+	}
+	
+	_ReadAddress = ReadAddress;
+	_ReadQty = ReadQty;
+	_Fields = Fields;
+	_FieldCount = FieldCount;
+	_Dest = (uint8_t *)Dest;
+	return startTransaction(MBSlave, MBReadInputRegisters);
+}
+
+/**
+ Typed Modbus function 0x03 Read Holding Registers, waiting for the reply.
+ 
+ @see ModbusMaster::startReadHoldingRegisters(uint8_t, uint16_t, uint16_t, const ModbusField *, uint8_t, void *)
+ @return 0 on success; exception number on failure
+ @ingroup register
+ */
+uint8_t ModbusMaster::readHoldingRegisters(uint8_t MBSlave, uint16_t ReadAddress,
+										   uint16_t ReadQty, const ModbusField *Fields,
+										   uint8_t FieldCount, void *Dest)
+{
+	uint8_t MBStatus;
+	
+	while ((MBStatus = startReadHoldingRegisters(MBSlave, ReadAddress, ReadQty, Fields, FieldCount, Dest)) == MBBusy)
+		;
+	
+	while ((MBStatus = poll()) == MBBusy)
+		;
+	
+	return MBStatus;
+}
+
+/**
+ Typed Modbus function 0x04 Read Input Registers, waiting for the reply.
+ 
+ @see ModbusMaster::startReadHoldingRegisters(uint8_t, uint16_t, uint16_t, const ModbusField *, uint8_t, void *)
+ @return 0 on success; exception number on failure
+ @ingroup register
+ */
+uint8_t ModbusMaster::readInputRegisters(uint8_t MBSlave, uint16_t ReadAddress,
+										 uint8_t ReadQty, const ModbusField *Fields,
+										 uint8_t FieldCount, void *Dest)
+{
+	uint8_t MBStatus;
+	
+	while ((MBStatus = startReadInputRegisters(MBSlave, ReadAddress, ReadQty, Fields, FieldCount, Dest)) == MBBusy)
+		;
+	
+	while ((MBStatus = poll()) == MBBusy)
+		;
+	
+	return MBStatus;
+}
+
+/**
+ Advance the transaction in progress.
+ 
+ Consumes whatever response bytes the transport has buffered and 
+ returns immediately; it never waits for the slave. Call it from loop() 
+ until it returns something other than MBBusy.
+ 
+ @return MBBusy while waiting; otherwise 0 on success or exception number 
+ on failure (the same value result() returns afterwards)
+ */
+uint8_t ModbusMaster::poll()
+{
+	int Data;
+	
+	if (_State != MBStateWaiting)
+	{
+		return _Status;
+	}
+	
+	while (_BytesLeft && !_Status && (Data = _Transport->read(_Transaction)) >= 0)
+	{
+		receiveByte(Data);
+		
+		// time the reply here rather than when the sketch next polls
+		if (!_BytesLeft)
+		{
+			_EndTime = millis();
+		}
+	}
+	
+	if (_BytesLeft && !_Status && (millis() - _StartTime) < _ResponseTimeout)
+	{
+		return MBBusy;
+	}
+	
+	endTransaction();
+	return _Status;
+}
+
+/**
+ Status of the last completed transaction.
+ 
+ @return MBBusy while a transaction is in progress; otherwise 0 on 
+ success or exception number on failure
+ */
+uint8_t ModbusMaster::result()
+{
+	return (_State == MBStateWaiting) ? MBBusy : _Status;
+}
+
+/**
+ Blocking Modbus transaction.
+ 
+ Starts the transaction and polls it to completion; kept for the 
+ read.../write... calls that wait for their reply.
  
  @param MBFunction Modbus function (0x01..0xFF)
  @return 0 on success; exception number on failure
  */
 uint8_t ModbusMaster::ModbusMasterTransaction(uint8_t MBSlave, uint8_t MBFunction)
 {
-	uint8_t ModbusADU[256];
-	uint8_t ModbusADUSize = 0;
+	uint8_t MBStatus;
+	
+	if (_State != MBStateIdle)
+	{
+		return MBBusy;
+	}
+	
+	_Dest = 0;
+	while (startTransaction(MBSlave, MBFunction) == MBBusy)
+		;
+	
+	while ((MBStatus = poll()) == MBBusy)
+		;
+	
+	return MBStatus;
+}
+
+/**
+ Length of the request PDU (function code and data) for a function.
+ 
+ @param MBFunction Modbus function (0x01..0xFF)
+ @return bytes startTransaction() will hand to the transport
+ */
+uint8_t ModbusMaster::requestLength(uint8_t MBFunction)
+{
+	switch(MBFunction)
+	{
+		case MBReadCoils:
+		case MBReadDiscreteInputs:
+		case MBReadInputRegisters:
+		case MBReadHoldingRegisters:
+		case MBWriteSingleCoil:
+		case MBWriteSingleRegister:
+			return 5;
+			
+		case MBWriteMultipleCoils:
+			return 6 + ((_WriteQty + 7) >> 3);
+			
+		case MBWriteMultipleRegisters:
+			return 6 + 2 * lowByte(_WriteQty);
+			
+		case MBMaskWriteRegister:
+			return 7;
+			
+		case MBReadWriteMultipleRegisters:
+			return 10 + 2 * lowByte(_WriteQty);
+	}
+	
+	return 1;
+}
+
+/**
+ Modbus transaction engine, request half.
+ Sequence:
+ - open a request frame on the transport
+ - assemble the Modbus Protocol Data Unit (PDU), based on particular 
+ function called, handing it straight to the transport
+ - close the frame; the transport adds its own framing (CRC, MBAP header)
+ - arm the response timeout; poll() does the rest
+ 
+ @param MBFunction Modbus function (0x01..0xFF)
+ @return 0 on success; MBBusy if the transport cannot take a request yet, 
+ e.g. the inter-frame gap has not passed; MBIllegalDataAddress if the 
+ request is too long for the transport
+ */
+uint8_t ModbusMaster::startTransaction(uint8_t MBSlave, uint8_t MBFunction)
+{
 	uint8_t i, Qty;
-	uint16_t CRC;
-	uint8_t TimeLeft = MBResponseTimeout;
-	uint8_t BytesLeft = 8;
-	uint8_t MBStatus = MBSuccess;
 	
-	///if(_RxTxTogglePin != -1)
-	///{
-	///	digitalWrite(_RxTxTogglePin, HIGH);
-	///	delay(1);
-	///}
+	switch(_Transport->beginRequest(_Transaction, MBSlave, requestLength(MBFunction)))
+	{
+		case ModbusTransport::MBTransportReady:
+			if (_Stats)
+			{
+				_Stats->Requests++;
+				_Stats->BytesSent++;
+			}
+			break;
+			
+
+		case ModbusTransport::MBTransportBusy:
+			return MBBusy;
+			
+		case ModbusTransport::MBTransportDown:
+			// nothing was sent; the first poll() reports it as a timeout
+			if (_Stats)
+			{
+				_Stats->Requests++;
+			}
+			_BytesLeft = 0;
+			_Status = MBResponseTimedOut;
+			_State = MBStateWaiting;
+			return MBSuccess;
+			
+		case ModbusTransport::MBTransportTooLong:
+			// refused before anything went out, so there is nothing to poll
+			_Status = MBIllegalDataAddress;
+			return _Status;
+	}
+	
+	_Slave = MBSlave;
+	_Function = MBFunction;
 	
-	// assemble Modbus Request Application Data Unit
-	ModbusADU[ModbusADUSize++] = MBSlave;
-	ModbusADU[ModbusADUSize++] = MBFunction;
+	sendByte(MBFunction);
 	
 	switch(MBFunction)
 	{
@@ -433,10 +903,10 @@ uint8_t ModbusMaster::ModbusMasterTransaction(uint8_t MBSlave, uint8_t MBFunctio
 		case MBReadInputRegisters:
 		case MBReadHoldingRegisters:
 		case MBReadWriteMultipleRegisters:
-			ModbusADU[ModbusADUSize++] = highByte(_ReadAddress);
-			ModbusADU[ModbusADUSize++] = lowByte(_ReadAddress);
-			ModbusADU[ModbusADUSize++] = highByte(_ReadQty);
-			ModbusADU[ModbusADUSize++] = lowByte(_ReadQty);
+			sendByte(highByte(_ReadAddress));
+			sendByte(lowByte(_ReadAddress));
+			sendByte(highByte(_ReadQty));
+			sendByte(lowByte(_ReadQty));
 			break;
 	}
 	
@@ -448,38 +918,34 @@ uint8_t ModbusMaster::ModbusMasterTransaction(uint8_t MBSlave, uint8_t MBFunctio
 		case MBWriteSingleRegister:
 		case MBWriteMultipleRegisters:
 		case MBReadWriteMultipleRegisters:
-			ModbusADU[ModbusADUSize++] = highByte(_WriteAddress);
-			ModbusADU[ModbusADUSize++] = lowByte(_WriteAddress);
+			sendByte(highByte(_WriteAddress));
+			sendByte(lowByte(_WriteAddress));
 			break;
 	}
 	
 	switch(MBFunction)
 	{
 		case MBWriteSingleCoil:
-			ModbusADU[ModbusADUSize++] = highByte(_WriteQty);
-			ModbusADU[ModbusADUSize++] = lowByte(_WriteQty);
-			break;
-			
 		case MBWriteSingleRegister:
-			ModbusADU[ModbusADUSize++] = highByte(_TransmitBuffer[0]);
-			ModbusADU[ModbusADUSize++] = lowByte(_TransmitBuffer[0]);
+			sendByte(highByte(_WriteQty));
+			sendByte(lowByte(_WriteQty));
 			break;
 			
 		case MBWriteMultipleCoils:
-			ModbusADU[ModbusADUSize++] = highByte(_WriteQty);
-			ModbusADU[ModbusADUSize++] = lowByte(_WriteQty);
+			sendByte(highByte(_WriteQty));
+			sendByte(lowByte(_WriteQty));
 			Qty = (_WriteQty % 8) ? ((_WriteQty >> 3) + 1) : (_WriteQty >> 3);
-			ModbusADU[ModbusADUSize++] = Qty;
+			sendByte(Qty);
 			for (i = 0; i < Qty; i++)
 			{
 				switch(i % 2)
 				{
 					case 0: // i is even
-						ModbusADU[ModbusADUSize++] = lowByte(_TransmitBuffer[i >> 1]);
+						sendByte(lowByte(_TransmitBuffer[i >> 1]));
 						break;
 						
 					case 1: // i is odd
-						ModbusADU[ModbusADUSize++] = highByte(_TransmitBuffer[i >> 1]);
+						sendByte(highByte(_TransmitBuffer[i >> 1]));
 						break;
 				}
 			}
@@ -487,193 +953,312 @@ uint8_t ModbusMaster::ModbusMasterTransaction(uint8_t MBSlave, uint8_t MBFunctio
 			
 		case MBWriteMultipleRegisters:
 		case MBReadWriteMultipleRegisters:
-			ModbusADU[ModbusADUSize++] = highByte(_WriteQty);
-			ModbusADU[ModbusADUSize++] = lowByte(_WriteQty);
-			ModbusADU[ModbusADUSize++] = lowByte(_WriteQty << 1);
+			sendByte(highByte(_WriteQty));
+			sendByte(lowByte(_WriteQty));
+			sendByte(lowByte(_WriteQty << 1));
 			
 			for (i = 0; i < lowByte(_WriteQty); i++)
 			{
-				ModbusADU[ModbusADUSize++] = highByte(_TransmitBuffer[i]);
-				ModbusADU[ModbusADUSize++] = lowByte(_TransmitBuffer[i]);
+				sendByte(highByte(_TransmitBuffer[i]));
+				sendByte(lowByte(_TransmitBuffer[i]));
 			}
 			break;
 			
 		case MBMaskWriteRegister:
-			ModbusADU[ModbusADUSize++] = highByte(_TransmitBuffer[0]);
-			ModbusADU[ModbusADUSize++] = lowByte(_TransmitBuffer[0]);
-			ModbusADU[ModbusADUSize++] = highByte(_TransmitBuffer[1]);
-			ModbusADU[ModbusADUSize++] = lowByte(_TransmitBuffer[1]);
+			sendByte(highByte(_WriteQty));
+			sendByte(lowByte(_WriteQty));
+			sendByte(highByte(_ReadQty));
+			sendByte(lowByte(_ReadQty));
 			break;
 	}
 	
+	_Transport->endRequest();
+	
+	_ADUSize = 0;
+	_BytesLeft = 3;
+	_Status = MBSuccess;
+	_State = MBStateWaiting;
+	_StartTime = millis();
+	
+	return MBSuccess;
+}
+
+/**
+ Hand one byte of the request PDU to the transport.
+ 
+ @param Data byte to send
+ */
+void ModbusMaster::sendByte(uint8_t Data)
+{
+	_Transport->write(Data);
+	
+	if (_Stats)
+	{
+		_Stats->BytesSent++;
+	}
+}
+
+/**
+ Modbus transaction engine, response half: take one received byte, 
+ evaluate the header once it has arrived and decode the data bytes 
+ as they come in.
+ 
+ @param Data byte read from the transport
+ */
+void ModbusMaster::receiveByte(uint8_t Data)
+{
+	_BytesLeft--;
+	
+	if (_Stats)
+	{
+		_Stats->BytesReceived++;
+	}
 	
-	// append CRC
-	CRC = 0xFFFF;
-	for (i = 0; i < ModbusADUSize; i++)
+	if (_ADUSize >= 3)
 	{
-		CRC = _crc16_update(CRC, ModbusADU[i]);
+		decodeByte(_ADUSize++ - 3, Data);
+		return;
 	}
-	ModbusADU[ModbusADUSize++] = lowByte(CRC);
-	ModbusADU[ModbusADUSize++] = highByte(CRC);
-	ModbusADU[ModbusADUSize] = 0;
 	
-	// transmit request
-	for (i = 0; i < ModbusADUSize; i++)
+	_Header[_ADUSize++] = Data;
+	
+	// evaluate slave ID, function code once enough bytes have been read
+	if (_ADUSize != 3)
 	{
-		MBSerial.write(ModbusADU[i]);
+		return;
 	}
 	
-	ModbusADUSize = 0;
-	MBSerial.flush();
+	// verify response is for correct Modbus slave
+	if (_Header[0] != _Slave)
+	{
+		_Status = MBInvalidSlaveID;
+		return;
+	}
 	
+	// verify response is for correct Modbus function code (mask exception bit 7)
+	if ((_Header[1] & 0x7F) != _Function)
+	{
+		_Status = MBInvalidFunction;
+		return;
+	}
 	
-	///if(_RxTxTogglePin != -1)
-	///{
-	///	delay(2);
-	///	digitalWrite(_RxTxTogglePin, LOW);
-	///}
+	// Modbus exception; only the transport's trailer follows the exception code
+	if (bitRead(_Header[1], 7))
+	{
+		_BytesLeft = _Transport->trailerSize();
+		return;
+	}
 	
-	// loop until we run out of time or bytes, or an error occurs
-	while (TimeLeft && BytesLeft && !MBStatus)
+	// evaluate returned Modbus function code
+	switch(_Header[1])
 	{
-		if (MBSerial.available())
-		{
-			ModbusADU[ModbusADUSize++] = MBSerial.read();
+		case MBReadCoils:
+		case MBReadDiscreteInputs:
+		case MBReadInputRegisters:
+		case MBReadHoldingRegisters:
+		case MBReadWriteMultipleRegisters:
+			_BytesLeft = _Header[2] + _Transport->trailerSize();
+			break;
 			
-			if(ModbusADUSize == 1 && (ModbusADU[ModbusADUSize-1] == 0x00 || ModbusADU[ModbusADUSize-1] == 0xFF))
-				ModbusADUSize--;
+		case MBWriteSingleCoil:
+		case MBWriteMultipleCoils:
+		case MBWriteSingleRegister:
+		case MBWriteMultipleRegisters:
+			_BytesLeft = 3 + _Transport->trailerSize();
+			break;
 			
-			BytesLeft--;
-		}
-		else
-		{
-			delayMicroseconds(1000);
-			TimeLeft--;
-		}
-		
-		// evaluate slave ID, function code once enough bytes have been read
-		if (ModbusADUSize == 5)
-		{
-			// verify response is for correct Modbus slave
-			if (ModbusADU[0] != MBSlave)
+		case MBMaskWriteRegister:
+			_BytesLeft = 5 + _Transport->trailerSize();
+			break;
+	}
+}
+
+/**
+ Place one data byte of a read response.
+ 
+ Typed reads scatter it straight into the caller's struct, everything else 
+ goes to the response buffer. Either way the values are only meaningful 
+ once the transaction has completed successfully.
+ 
+ @param Index position of the byte after the response header
+ @param Data byte read from the transport
+ */
+void ModbusMaster::decodeByte(uint8_t Index, uint8_t Data)
+{
+	uint8_t i, Register, Word;
+	
+	switch(_Header[1])
+	{
+		case MBReadCoils:
+		case MBReadDiscreteInputs:
+			// the transport's trailer follows the data
+			if (Index >= _Header[2])
 			{
-				MBStatus = MBInvalidSlaveID;
-				//Serial.print("Error Invalid Slave ID: ");
-				//Serial.println((int)ModbusADU[0]);
 				break;
 			}
 			
-			// verify response is for correct Modbus function code (mask exception bit 7)
-			if ((ModbusADU[1] & 0x7F) != MBFunction)
+			// load bytes into word; response bytes are ordered L, H, L, H, ...
+			// an odd last byte leaves a zero-padded word
+			if ((Index >> 1) < _ResponseBufferSize)
 			{
-				MBStatus = MBInvalidFunction;
-				break;
+				if (Index & 1)
+				{
+					_ResponseBuffer[Index >> 1] |= (uint16_t)Data << 8;
+				}
+				else
+				{
+					_ResponseBuffer[Index >> 1] = Data;
+				}
 			}
+			break;
 			
-			// check whether Modbus exception occurred; return Modbus Exception Code
-			if (bitRead(ModbusADU[1], 7))
+		case MBReadInputRegisters:
+		case MBReadHoldingRegisters:
+		case MBReadWriteMultipleRegisters:
+			// the transport's trailer follows the data
+			if (Index >= _Header[2])
 			{
-				MBStatus = ModbusADU[2];
 				break;
 			}
 			
-			// evaluate returned Modbus function code
-			switch(ModbusADU[1])
+			if (!_Dest)
 			{
-				case MBReadCoils:
-				case MBReadDiscreteInputs:
-				case MBReadInputRegisters:
-				case MBReadHoldingRegisters:
-				case MBReadWriteMultipleRegisters:
-					BytesLeft = ModbusADU[2];
-					break;
-					
-				case MBWriteSingleCoil:
-				case MBWriteMultipleCoils:
-				case MBWriteSingleRegister:
-					BytesLeft = 3;
-					break;
-					
-				case MBMaskWriteRegister:
-					BytesLeft = 5;
-					break;
+				// load bytes into word; response bytes are ordered H, L, H, L, ...
+				if ((Index >> 1) < _ResponseBufferSize)
+				{
+					if (Index & 1)
+					{
+						_ResponseBuffer[Index >> 1] |= Data;
+					}
+					else
+					{
+						_ResponseBuffer[Index >> 1] = (uint16_t)Data << 8;
+					}
+				}
+				break;
 			}
-		}
-		
-		if (ModbusADUSize == 6)
-		{
-			switch(ModbusADU[1])
+			
+			// registers are big-endian words; the fields are stored little-endian
+			Register = Index >> 1;
+			for (i = 0; i < _FieldCount; i++)
 			{
-				case MBWriteMultipleRegisters:
-					BytesLeft = ModbusADU[5];
-					break;
+				if (Register < _Fields[i].Register)
+				{
+					continue;
+				}
+				
+				Word = Register - _Fields[i].Register;
+				if ((_Fields[i].Type & ~MBWordSwap) >= MBFieldU32)
+				{
+					if (Word > 1)
+					{
+						continue;
+					}
+					
+					// high word first unless swapped
+					if (!(_Fields[i].Type & MBWordSwap))
+					{
+						Word = 1 - Word;
+					}
+				}
+				else if (Word > 0)
+				{
+					continue;
+				}
+				
+				_Dest[_Fields[i].Offset + 2 * Word + ((Index & 1) ? 0 : 1)] = Data;
 			}
-		}
+			break;
 	}
+}
+
+/**
+ Modbus transaction engine, completion.
+ Sequence:
+ - verify the response was complete and intact
+ - record status (success/exception) for result()
+ */
+void ModbusMaster::endTransaction()
+{
+	bool Valid;
+	
+	_State = MBStateIdle;
+	Valid = _Transport->endResponse(_Transaction);
 	
 	// verify response is large enough to inspect further
-	if (!MBStatus && (TimeLeft == 0 || ModbusADUSize < 5))
+	if (!_Status && _BytesLeft)
 	{
-		MBStatus = MBResponseTimedOut;
+		_Status = MBResponseTimedOut;
 	}
 	
-	// calculate CRC
-	CRC = 0xFFFF;
-	for (i = 0; i < (ModbusADUSize - 2); i++)
+	// verify CRC (RTU); TCP has already checked the frame
+	if (!_Status && !Valid)
 	{
-		CRC = _crc16_update(CRC, ModbusADU[i]);
+		_Status = MBInvalidCRC;
 	}
 	
-	// verify CRC
-	if (!MBStatus && (lowByte(CRC) != ModbusADU[ModbusADUSize - 2] ||
-						highByte(CRC) != ModbusADU[ModbusADUSize - 1]))
+	// check whether Modbus exception occurred; return Modbus Exception Code
+	if (!_Status && bitRead(_Header[1], 7))
 	{
-		MBStatus = MBInvalidCRC;
+		_Status = _Header[2];
 	}
 	
-	// disassemble ADU into words
-	if (!MBStatus)
+	if (!_Status)
 	{
-		// evaluate returned Modbus function code
-		switch(ModbusADU[1])
-		{
-			case MBReadCoils:
-			case MBReadDiscreteInputs:
-				// load bytes into word; response bytes are ordered L, H, L, H, ...
-				for (i = 0; i < (ModbusADU[2] >> 1); i++)
-				{
-					if (i < MaxBufferSize)
-					{
-						_ResponseBuffer[i] = word(ModbusADU[2 * i + 4], ModbusADU[2 * i + 3]);
-					}
-				}
-				
-				// in the event of an odd number of bytes, load last byte into zero-padded word
-				if (ModbusADU[2] % 2)
-				{
-					if (i < MaxBufferSize)
-					{
-						_ResponseBuffer[i] = word(0, ModbusADU[2 * i + 3]);
-					}
-				}
-				break;
-				
-			case MBReadInputRegisters:
-			case MBReadHoldingRegisters:
-			case MBReadWriteMultipleRegisters:
-				// load bytes into word; response bytes are ordered H, L, H, L, ...
-				for (i = 0; i < (ModbusADU[2] >> 1); i++)
-				{
-					if (i < MaxBufferSize)
-					{
-						_ResponseBuffer[i] = word(ModbusADU[2 * i + 3], ModbusADU[2 * i + 4]);
-					}
-				}
-				break;
-		}
+		_Latency = _EndTime - _StartTime;
 	}
 	
-	return MBStatus;
+	if (_Stats)
+	{
+		recordStats();
+	}
 }
 
-ModbusMaster Modbus = ModbusMaster();
+/**
+ Count the transaction that just completed into the attached ModbusStats.
+ */
+void ModbusMaster::recordStats()
+{
+	uint8_t Bucket;
+	
+	switch(_Status)
+	{
+		case MBSuccess:
+			for (Bucket = 0; Bucket < MB_LATENCY_BUCKETS - 1; Bucket++)
+			{
+				if (_Latency < latencyBucketLimit(Bucket))
+				{
+					break;
+				}
+			}
+			_Stats->Latency[Bucket]++;
+			break;
+			
+		case MBResponseTimedOut:
+			_Stats->Timeouts++;
+			break;
+			
+		case MBInvalidCRC:
+			_Stats->CRCErrors++;
+			break;
+			
+		case MBInvalidSlaveID:
+			_Stats->SlaveIDErrors++;
+			break;
+			
+		case MBInvalidFunction:
+			_Stats->FunctionErrors++;
+			break;
+			
+		case MBIllegalFunction:
+		case MBIllegalDataAddress:
+		case MBIllegalDataValue:
+		case MBSlaveDeviceFailure:
+			_Stats->Exceptions[_Status - 1]++;
+			break;
+			
+		default:
+			_Stats->Exceptions[4]++;
+			break;
+	}
+}
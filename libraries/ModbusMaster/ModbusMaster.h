@@ -22,23 +22,84 @@
 #define ModbusMaster_h
 
 #include "Arduino.h"
-#include <util/crc16.h>
+#include "ModbusTransport.h"
 
 #define lowWord(ww) ((uint16_t) ((ww) & 0xFFFF))
 #define highWord(ww) ((uint16_t) ((ww) >> 16))
 #define LONG(hi, lo) ((uint32_t) ((hi) << 16 | (lo)))
 
+/**
+ One typed value decoded straight out of a read response into a field of 
+ the caller's struct.
+ 
+ @see ModbusMaster::startReadHoldingRegisters(uint8_t, uint16_t, uint16_t, const ModbusField *, uint8_t, void *)
+ */
+typedef struct
+{
+	uint8_t Register; ///< first register of the value, relative to the read address
+	uint8_t Type;     ///< MBFieldU16..MBFieldF32, or'ed with MBWordSwap for low word first
+	uint8_t Offset;   ///< byte offset of the destination field, e.g. offsetof()
+} ModbusField;
+
+// round trip histogram buckets: under 4, 8, 16 ... 256 ms, and the rest
+#define MB_LATENCY_BUCKETS 8
+
+/**
+ Transaction counters for one slave, filled in by the engine while 
+ attached with ModbusMaster::setStats(). Counters wrap.
+ */
+typedef struct
+{
+	uint16_t Requests;
+	uint16_t Latency[MB_LATENCY_BUCKETS]; ///< successful replies by round trip time
+	uint16_t Timeouts;                    ///< MBResponseTimedOut, incl. transport down
+	uint16_t CRCErrors;                   ///< MBInvalidCRC
+	uint16_t SlaveIDErrors;               ///< MBInvalidSlaveID
+	uint16_t FunctionErrors;              ///< MBInvalidFunction
+	uint16_t Exceptions[5];               ///< exception codes 0x01..0x04, anything else last
+	uint32_t BytesSent;                   ///< slave ID and PDU, excluding transport framing
+	uint32_t BytesReceived;               ///< everything the transport handed back
+} ModbusStats;
+
 class ModbusMaster
 {
 	private:
 		///uint8_t  _RxTxTogglePin;
-		static const uint8_t MaxBufferSize                = 64;
+		ModbusRTUTransport _RTU;
+		ModbusTransport *_Transport;
 		uint16_t _ReadAddress;
 		uint16_t _ReadQty;
-		uint16_t _ResponseBuffer[MaxBufferSize];
 		uint16_t _WriteAddress;
 		uint16_t _WriteQty;
-		uint16_t _TransmitBuffer[MaxBufferSize];
+		
+		// word buffers of the untyped reads and multiple writes, the caller's 
+		// so sketches that only use typed reads spend no RAM on them
+		uint16_t *_ResponseBuffer;
+		uint8_t  _ResponseBufferSize;
+		uint16_t *_TransmitBuffer;
+		uint8_t  _TransmitBufferSize;
+		
+		// transaction state, kept between calls to poll(); the response is 
+		// decoded as it arrives so only its header is kept
+		uint8_t  _Header[3];
+		uint8_t  _ADUSize;
+		uint8_t  _BytesLeft;
+		uint8_t  _Slave;
+		uint8_t  _Function;
+		uint8_t  _State;
+		uint8_t  _Status;
+		uint16_t _Transaction;
+		uint32_t _StartTime;
+		uint32_t _EndTime;       // when the last byte of the reply came in
+		uint16_t _ResponseTimeout;
+		uint16_t _Latency;
+		const ModbusField *_Fields;
+		uint8_t  _FieldCount;
+		uint8_t  *_Dest;
+		ModbusStats *_Stats;
+		
+		static const uint8_t MBStateIdle                  = 0;
+		static const uint8_t MBStateWaiting               = 1;
 		
 		// Modbus function codes for bit access
 		static const uint8_t MBReadCoils                  = 0x01;
@@ -54,13 +115,20 @@ class ModbusMaster
 		static const uint8_t MBMaskWriteRegister          = 0x16;
 		static const uint8_t MBReadWriteMultipleRegisters = 0x17;
 		
-		// Modbus timeout [milliseconds]
-		static const uint8_t MBResponseTimeout            = 3000;
-		
-		// master function that conducts Modbus transactions
+		// master functions that conduct Modbus transactions
 		uint8_t ModbusMasterTransaction(uint8_t, uint8_t);
+		uint8_t startTransaction(uint8_t, uint8_t);
+		uint8_t requestLength(uint8_t);
+		void    sendByte(uint8_t);
+		void    receiveByte(uint8_t);
+		void    decodeByte(uint8_t, uint8_t);
+		void    endTransaction();
+		void    recordStats();
 	
 	public:		
+		// Modbus timeout [milliseconds], the longest setResponseTimeout() allows
+		static const uint16_t MBResponseTimeout           = 200;
+		
 		// Modbus exception codes
 		static const uint8_t MBIllegalFunction            = 0x01;
 		static const uint8_t MBIllegalDataAddress         = 0x02;
@@ -73,11 +141,27 @@ class ModbusMaster
 		static const uint8_t MBInvalidFunction            = 0xE1;
 		static const uint8_t MBResponseTimedOut           = 0xE2;
 		static const uint8_t MBInvalidCRC                 = 0xE3;
+		static const uint8_t MBBusy                       = 0xE4;
+		
+		// ModbusField types
+		static const uint8_t MBFieldU16                   = 0x00;
+		static const uint8_t MBFieldS16                   = 0x01;
+		static const uint8_t MBFieldU32                   = 0x02;
+		static const uint8_t MBFieldS32                   = 0x03;
+		static const uint8_t MBFieldF32                   = 0x04;
+		static const uint8_t MBWordSwap                   = 0x80;
 
 		ModbusMaster();
-		void begin(uint16_t);
-		void begin(uint8_t, uint16_t);
+		void begin(uint32_t);
+		void begin(uint8_t, uint32_t);
+		void begin(ModbusTransport &);
+		void     setResponseTimeout(uint16_t);
+		uint16_t lastLatency();
+		void     setStats(ModbusStats *);
+		static uint16_t latencyBucketLimit(uint8_t);
 		
+		void     attachResponseBuffer(uint16_t *, uint8_t);
+		void     attachTransmitBuffer(uint16_t *, uint8_t);
 		uint16_t getResponseBuffer(uint8_t);
 		void     clearResponseBuffer();
 		uint8_t  setTransmitBuffer(uint8_t, uint16_t);
@@ -93,9 +177,17 @@ class ModbusMaster
 		uint8_t  writeMultipleRegisters(uint8_t, uint16_t, uint16_t);
 		uint8_t  maskWriteRegister(uint8_t, uint16_t, uint16_t, uint16_t);
 		uint8_t  readWriteMultipleRegisters(uint8_t, uint16_t, uint16_t, uint16_t, uint16_t);
-    
+		
+		uint8_t  startReadCoils(uint8_t, uint16_t, uint16_t);
+		uint8_t  startReadDiscreteInputs(uint8_t, uint16_t, uint16_t);
+		uint8_t  startReadHoldingRegisters(uint8_t, uint16_t, uint16_t);
+		uint8_t  startReadInputRegisters(uint8_t, uint16_t, uint8_t);
+		uint8_t  startReadHoldingRegisters(uint8_t, uint16_t, uint16_t, const ModbusField *, uint8_t, void *);
+		uint8_t  startReadInputRegisters(uint8_t, uint16_t, uint8_t, const ModbusField *, uint8_t, void *);
+		uint8_t  readHoldingRegisters(uint8_t, uint16_t, uint16_t, const ModbusField *, uint8_t, void *);
+		uint8_t  readInputRegisters(uint8_t, uint16_t, uint8_t, const ModbusField *, uint8_t, void *);
+		uint8_t  poll();
+		uint8_t  result();
 };
 
-extern ModbusMaster Modbus;
-
 #endif
@@ -0,0 +1,494 @@
+/*
+ ModbusTransport.cpp - Modbus transports (RTU serial, TCP, loopback) for ModbusMaster
+ Copyright (C) 2010 Doc Walker and Stephen Makonin.  All right reserved.
+ 
+ ModbusMaster is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ ModbusMaster is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with ModbusMaster.  If not, see <http://www.gnu.org/licenses/>. 
+*/
+
+#include "ModbusTransport.h"
+
+
+ModbusRTUTransport::ModbusRTUTransport(void)
+{
+	_Serial = &Serial;
+	_FrameGap = MBMinFrameGap;
+	_FrameEndTime = 0;
+	_Busy = false;
+	_CRC = 0xFFFF;
+	_FrameStarted = false;
+}
+
+/**
+ Open the serial port.
+ 
+ @param Port serial port the RS485 transceiver is on
+ @param BaudRate line speed
+ */
+void ModbusRTUTransport::begin(HardwareSerial &Port, uint32_t BaudRate)
+{
+	_Serial = &Port;
+	_Serial->begin(BaudRate);
+	
+	// 3.5 character times (11 bits each) of silence mark the end of a frame; 
+	// the spec fixes it at 1.75 ms above 19200 baud
+	_FrameGap = (BaudRate > 19200) ? MBMinFrameGap : (uint16_t)(38500000UL / BaudRate);
+}
+
+uint8_t ModbusRTUTransport::beginRequest(uint16_t &Transaction, uint8_t Slave, uint8_t)
+{
+	// slaves only see a new frame after 3.5 characters of silence
+	if (_Busy || (micros() - _FrameEndTime) < _FrameGap)
+	{
+		return MBTransportBusy;
+	}
+	
+	// drop anything left over from an earlier, abandoned reply
+	while (_Serial->available())
+	{
+		_Serial->read();
+	}
+	
+	_Busy = true;
+	Transaction = 0;
+	_CRC = 0xFFFF;
+	write(Slave);
+	return MBTransportReady;
+}
+
+void ModbusRTUTransport::write(uint8_t Data)
+{
+	// a read request is 8 bytes and fits in the UART transmit buffer, so 
+	// this does not wait on the line
+	_Serial->write(Data);
+	_CRC = crc16Update(_CRC, Data);
+}
+
+void ModbusRTUTransport::endRequest()
+{
+	uint16_t CRC = _CRC;
+	
+	_Serial->write(lowByte(CRC));
+	_Serial->write(highByte(CRC));
+	
+	_CRC = 0xFFFF;
+	_FrameStarted = false;
+}
+
+int ModbusRTUTransport::read(uint16_t)
+{
+	uint8_t Data;
+	
+	while (_Serial->available())
+	{
+		Data = _Serial->read();
+		
+		// skip line noise ahead of the slave ID
+		if (!_FrameStarted && (Data == 0x00 || Data == 0xFF))
+		{
+			continue;
+		}
+		
+		// the CRC is checked as the bytes arrive rather than in a second pass
+		_FrameStarted = true;
+		_CRC = crc16Update(_CRC, Data);
+		return Data;
+	}
+	
+	return -1;
+}
+
+uint8_t ModbusRTUTransport::trailerSize()
+{
+	return 2;
+}
+
+bool ModbusRTUTransport::endResponse(uint16_t)
+{
+	_Busy = false;
+	_FrameEndTime = micros();
+	
+	// running the CRC over the received CRC bytes as well leaves 0
+	return _CRC == 0;
+}
+
+
+/**
+ @param Socket client for the connection to the gateway or slave, e.g. an 
+ EthernetClient; opening it is left to the sketch
+ */
+ModbusTCPTransport::ModbusTCPTransport(Client &Socket)
+{
+	uint8_t i;
+	
+	_Client = &Socket;
+	_NextTransaction = 1;
+	_FrameSize = 0;
+	_HeaderSize = 0;
+	_RxLeft = 0;
+	
+	for (i = 0; i < MB_TCP_MAX_PENDING; i++)
+	{
+		_Pending[i] = 0;
+	}
+}
+
+uint8_t ModbusTCPTransport::beginRequest(uint16_t &Transaction, uint8_t Slave, uint8_t Length)
+{
+	uint8_t i, Slot = MB_TCP_MAX_PENDING;
+	
+	Transaction = 0;
+	
+	// the MBAP length must not claim more than write() can buffer
+	if (Length > MB_TCP_BUFFER_SIZE - 7)
+	{
+		return MBTransportTooLong;
+	}
+	
+	for (i = 0; i < MB_TCP_MAX_PENDING; i++)
+	{
+		if (!_Pending[i])
+		{
+			Slot = i;
+		}
+	}
+	
+	if (Slot == MB_TCP_MAX_PENDING)
+	{
+		return MBTransportBusy;
+	}
+	
+	// connecting can take seconds, so it is not done here; until the sketch 
+	// has the connection (back) up, requests fail and are retried on a later 
+	// poll. Replies still owed on a dropped connection are lost, their 
+	// masters will time out.
+	if (!_Client->connected())
+	{
+		_HeaderSize = 0;
+		_RxLeft = 0;
+		
+		for (i = 0; i < MB_TCP_MAX_PENDING; i++)
+		{
+			_Pending[i] = 0;
+		}
+		
+		return MBTransportDown;
+	}
+	
+	// transaction ID 0 marks a free slot
+	Transaction = _NextTransaction++;
+	if (!_NextTransaction)
+	{
+		_NextTransaction = 1;
+	}
+	_Pending[Slot] = Transaction;
+	
+	// MBAP header: transaction, protocol 0, length of unit ID and PDU, unit ID
+	_FrameSize = 0;
+	_Frame[_FrameSize++] = highByte(Transaction);
+	_Frame[_FrameSize++] = lowByte(Transaction);
+	_Frame[_FrameSize++] = 0;
+	_Frame[_FrameSize++] = 0;
+	_Frame[_FrameSize++] = 0;
+	_Frame[_FrameSize++] = Length + 1;
+	_Frame[_FrameSize++] = Slave;
+	return MBTransportReady;
+}
+
+void ModbusTCPTransport::write(uint8_t Data)
+{
+	if (_FrameSize < MB_TCP_BUFFER_SIZE)
+	{
+		_Frame[_FrameSize++] = Data;
+	}
+}
+
+void ModbusTCPTransport::endRequest()
+{
+	// one write so the request goes out as one segment
+	_Client->write(_Frame, _FrameSize);
+	_FrameSize = 0;
+}
+
+/**
+ Transaction ID of the response at the head of the connection.
+ */
+uint16_t ModbusTCPTransport::rxTransaction()
+{
+	return word(_Header[0], _Header[1]);
+}
+
+bool ModbusTCPTransport::isPending(uint16_t Transaction)
+{
+	uint8_t i;
+	
+	for (i = 0; i < MB_TCP_MAX_PENDING; i++)
+	{
+		if (_Pending[i] == Transaction)
+		{
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+/**
+ Discard what has arrived of the response at the head of the connection.
+ */
+void ModbusTCPTransport::skipFrame()
+{
+	while (_RxLeft && _Client->available())
+	{
+		_Client->read();
+		_RxLeft--;
+	}
+	
+	if (!_RxLeft)
+	{
+		_HeaderSize = 0;
+	}
+}
+
+int ModbusTCPTransport::read(uint16_t Transaction)
+{
+	uint8_t Data;
+	
+	for (;;)
+	{
+		// MBAP header up to the length field; the unit ID is handed on
+		if (!_RxLeft)
+		{
+			while (_HeaderSize < sizeof(_Header) && _Client->available())
+			{
+				_Header[_HeaderSize++] = _Client->read();
+			}
+			
+			if (_HeaderSize < sizeof(_Header))
+			{
+				return -1;
+			}
+			
+			_RxLeft = word(_Header[4], _Header[5]);
+			if (!_RxLeft)
+			{
+				_HeaderSize = 0;
+				continue;
+			}
+		}
+		
+		// a reply nobody is waiting for any more
+		if (!isPending(rxTransaction()))
+		{
+			skipFrame();
+			if (_RxLeft)
+			{
+				return -1;
+			}
+			continue;
+		}
+		
+		// another master's reply; it stays put until that master polls
+		if (rxTransaction() != Transaction || !_Client->available())
+		{
+			return -1;
+		}
+		
+		Data = _Client->read();
+		if (!--_RxLeft)
+		{
+			_HeaderSize = 0;
+		}
+		return Data;
+	}
+}
+
+uint8_t ModbusTCPTransport::trailerSize()
+{
+	return 0;
+}
+
+bool ModbusTCPTransport::endResponse(uint16_t Transaction)
+{
+	uint8_t i;
+	
+	for (i = 0; i < MB_TCP_MAX_PENDING; i++)
+	{
+		if (_Pending[i] == Transaction)
+		{
+			_Pending[i] = 0;
+		}
+	}
+	
+	// anything left of our own reply is now stale
+	if (_RxLeft && rxTransaction() == Transaction)
+	{
+		skipFrame();
+	}
+	
+	// TCP already checked it
+	return true;
+}
+
+
+/**
+ @param Registers register bank the stand-in slave serves
+ @param RegisterCount number of registers in the bank
+ */
+ModbusLoopbackTransport::ModbusLoopbackTransport(uint16_t *Registers, uint16_t RegisterCount)
+{
+	_Registers = Registers;
+	_RegisterCount = RegisterCount;
+	_RequestSize = 0;
+	_ResponseSize = 0;
+	_ResponseIndex = 0;
+}
+
+uint8_t ModbusLoopbackTransport::beginRequest(uint16_t &Transaction, uint8_t Slave, uint8_t)
+{
+	Transaction = 0;
+	_Request[0] = Slave;
+	_RequestSize = 1;
+	_ResponseSize = 0;
+	_ResponseIndex = 0;
+	_Exception = 0;
+	return MBTransportReady;
+}
+
+void ModbusLoopbackTransport::write(uint8_t Data)
+{
+	uint16_t Address;
+	
+	// slave, function, address, quantity and byte count are kept
+	if (_RequestSize < sizeof(_Request))
+	{
+		_Request[_RequestSize++] = Data;
+		return;
+	}
+	
+	// the data of a 0x10 write goes straight into the register bank
+	if (!((_RequestSize++ - sizeof(_Request)) & 1))
+	{
+		_WriteHigh = Data;
+		return;
+	}
+	
+	Address = word(_Request[2], _Request[3]) + ((_RequestSize - sizeof(_Request) - 1) >> 1);
+	if (_Request[1] == 0x10 && Address < _RegisterCount)
+	{
+		_Registers[Address] = word(_WriteHigh, Data);
+	}
+}
+
+void ModbusLoopbackTransport::endRequest()
+{
+	uint16_t Address = word(_Request[2], _Request[3]);
+	uint16_t Qty = word(_Request[4], _Request[5]);
+	
+	switch (_Request[1])
+	{
+		case 0x03:
+		case 0x04:
+			if (!Qty || Qty > 125 || (uint32_t)Address + Qty > _RegisterCount)
+			{
+				_Exception = 0x02;
+				break;
+			}
+			_ResponseSize = 3 + 2 * Qty;
+			break;
+			
+		case 0x06:
+			if (Address >= _RegisterCount)
+			{
+				_Exception = 0x02;
+				break;
+			}
+			_Registers[Address] = Qty;
+			_ResponseSize = 6;
+			break;
+			
+		case 0x10:
+			if ((uint32_t)Address + Qty > _RegisterCount)
+			{
+				_Exception = 0x02;
+				break;
+			}
+			_ResponseSize = 6;
+			break;
+			
+		default:
+			_Exception = 0x01;
+			break;
+	}
+	
+	if (_Exception)
+	{
+		_ResponseSize = 3;
+	}
+}
+
+/**
+ Byte Index of the reply to the last request.
+ */
+uint8_t ModbusLoopbackTransport::responseByte(uint16_t Index)
+{
+	uint16_t Value;
+	
+	if (Index == 0)
+	{
+		return _Request[0];
+	}
+	
+	if (_Exception)
+	{
+		return (Index == 1) ? (_Request[1] | 0x80) : _Exception;
+	}
+	
+	// writes echo address and quantity (or value)
+	if (_Request[1] == 0x06 || _Request[1] == 0x10)
+	{
+		return _Request[Index];
+	}
+	
+	switch (Index)
+	{
+		case 1:
+			return _Request[1];
+			
+		case 2:
+			return _ResponseSize - 3;
+	}
+	
+	Value = _Registers[word(_Request[2], _Request[3]) + ((Index - 3) >> 1)];
+	return ((Index - 3) & 1) ? lowByte(Value) : highByte(Value);
+}
+
+int ModbusLoopbackTransport::read(uint16_t)
+{
+	if (_ResponseIndex < _ResponseSize)
+	{
+		return responseByte(_ResponseIndex++);
+	}
+	
+	return -1;
+}
+
+uint8_t ModbusLoopbackTransport::trailerSize()
+{
+	return 0;
+}
+
+bool ModbusLoopbackTransport::endResponse(uint16_t)
+{
+	return true;
+}
@@ -0,0 +1,189 @@
+/*
+ ModbusTransport.h - Modbus transports (RTU serial, TCP, loopback) for ModbusMaster
+ Copyright (C) 2010 Doc Walker and Stephen Makonin.  All right reserved.
+ 
+ ModbusMaster is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ ModbusMaster is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with ModbusMaster.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ModbusTransport_h
+#define ModbusTransport_h
+
+#include "Arduino.h"
+#include "Client.h"
+#include "IPAddress.h"
+#include "ModbusCRC.h"
+
+// requests the TCP transport can have outstanding at once
+#ifndef MB_TCP_MAX_PENDING
+#define MB_TCP_MAX_PENDING 4
+#endif
+
+// largest request the TCP transport sends: MBAP header, a write of 
+// 64 registers and its 6 byte PDU header
+#ifndef MB_TCP_BUFFER_SIZE
+#define MB_TCP_BUFFER_SIZE 141
+#endif
+
+/**
+ How ModbusMaster gets a request to a slave and the reply back.
+ 
+ The transaction engine hands over the slave ID and the protocol data 
+ unit (function code and data); the transport adds and strips its own 
+ framing. Responses are handed back a byte at a time starting with the 
+ slave ID, followed by trailerSize() bytes of framing the engine skips.
+ */
+class ModbusTransport
+{
+	public:
+		// beginRequest() results
+		static const uint8_t MBTransportReady             = 0;
+		static const uint8_t MBTransportBusy              = 1;
+		static const uint8_t MBTransportDown              = 2;
+		static const uint8_t MBTransportTooLong           = 3;
+		
+		/**
+		 Start a request frame.
+		 
+		 @param Transaction set to the ID to pass to read() and endResponse()
+		 @param Slave Modbus slave ID (unit identifier on TCP)
+		 @param Length bytes of PDU that will follow through write()
+		 @return MBTransportReady to go ahead; MBTransportBusy to try again 
+		 later; MBTransportDown if the slave cannot be reached at all; 
+		 MBTransportTooLong if the request does not fit the transport's frame
+		 */
+		virtual uint8_t  beginRequest(uint16_t &Transaction, uint8_t Slave, uint8_t Length) = 0;
+		virtual void     write(uint8_t Data) = 0;
+		virtual void     endRequest() = 0;
+		
+		/**
+		 Next byte of the response to a transaction.
+		 
+		 @return 0x00..0xFF, or -1 if nothing has arrived for it yet
+		 */
+		virtual int      read(uint16_t Transaction) = 0;
+		
+		/**
+		 Bytes of framing after the PDU (the RTU CRC).
+		 */
+		virtual uint8_t  trailerSize() = 0;
+		
+		/**
+		 Finish a transaction, complete or abandoned.
+		 
+		 @return true if the received frame passed the transport's own 
+		 integrity check
+		 */
+		virtual bool     endResponse(uint16_t Transaction) = 0;
+};
+
+/**
+ Modbus RTU over a serial port: CRC-16 trailer, 3.5 character gap 
+ between frames, one transaction at a time.
+ */
+class ModbusRTUTransport : public ModbusTransport
+{
+	private:
+		HardwareSerial *_Serial;
+		uint16_t _CRC;
+		uint16_t _FrameGap;
+		uint32_t _FrameEndTime;
+		bool     _Busy;
+		bool     _FrameStarted;
+		
+		// silent interval between frames above 19200 baud [microseconds]
+		static const uint16_t MBMinFrameGap               = 1750;
+		
+	public:
+		ModbusRTUTransport();
+		void     begin(HardwareSerial &, uint32_t);
+		
+		uint8_t  beginRequest(uint16_t &, uint8_t, uint8_t);
+		void     write(uint8_t);
+		void     endRequest();
+		int      read(uint16_t);
+		uint8_t  trailerSize();
+		bool     endResponse(uint16_t);
+};
+
+/**
+ Modbus TCP: MBAP header instead of a CRC, with several requests 
+ outstanding on one connection.
+ 
+ Share one instance between several ModbusMaster objects to pipeline 
+ requests to a gateway; each response is handed to the master whose 
+ transaction ID it carries. The sketch opens the connection, and opens it 
+ again when it drops, without holding up the masters: while it is down 
+ their requests end in a timeout.
+ */
+class ModbusTCPTransport : public ModbusTransport
+{
+	private:
+		Client   *_Client;
+		uint16_t _NextTransaction;
+		uint16_t _Pending[MB_TCP_MAX_PENDING];
+		uint8_t  _Frame[MB_TCP_BUFFER_SIZE];
+		uint8_t  _FrameSize;
+		uint8_t  _Header[6];
+		uint8_t  _HeaderSize;
+		uint16_t _RxLeft;
+		
+		uint16_t rxTransaction();
+		bool     isPending(uint16_t);
+		void     skipFrame();
+		
+	public:
+		ModbusTCPTransport(Client &);
+		
+		uint8_t  beginRequest(uint16_t &, uint8_t, uint8_t);
+		void     write(uint8_t);
+		void     endRequest();
+		int      read(uint16_t);
+		uint8_t  trailerSize();
+		bool     endResponse(uint16_t);
+};
+
+/**
+ In-memory stand-in for a slave, for testing and benchmarking the 
+ transaction engine without hardware.
+ 
+ Answers every slave ID from one register bank: function 0x03/0x04 reads 
+ and 0x06/0x10 writes; anything else gets an illegal function exception. 
+ Replies are generated as they are read, so no frame is buffered.
+ */
+class ModbusLoopbackTransport : public ModbusTransport
+{
+	private:
+		uint16_t *_Registers;
+		uint16_t _RegisterCount;
+		uint8_t  _Request[7];
+		uint16_t _RequestSize;
+		uint8_t  _WriteHigh;
+		uint8_t  _Exception;
+		uint16_t _ResponseSize;
+		uint16_t _ResponseIndex;
+		
+		uint8_t  responseByte(uint16_t);
+		
+	public:
+		ModbusLoopbackTransport(uint16_t *, uint16_t);
+		
+		uint8_t  beginRequest(uint16_t &, uint8_t, uint8_t);
+		void     write(uint8_t);
+		void     endRequest();
+		int      read(uint16_t);
+		uint8_t  trailerSize();
+		bool     endResponse(uint16_t);
+};
+
+#endif
@@ -19,6 +19,8 @@
   6  Jan 2010 - initial release 
   12 Feb 2010 - fixed leap year calculation error
   1  Nov 2010 - fixed setTime bug (thanks to Korman for this)
+  breakTime and makeTime in constant time, cache advanced incrementally
+  seconds can be counted from a 1 Hz interrupt (secondTick) instead of millis
 */
 
 #include <Arduino.h> 
@@ -27,14 +29,29 @@
 
 static tmElements_t tm;          // a cache of time elements
 static time_t       cacheTime;   // the time the cache was updated
+static bool         cacheValid = false;
 static time_t       syncInterval = 300;  // time sync will be attempted after this many seconds
 
 void refreshCache( time_t t){
-  if( t != cacheTime)
-  {
-    breakTime(t, tm); 
-    cacheTime = t; 
+  if( cacheValid && t == cacheTime)
+    return;
+    
+  if( cacheValid && t > cacheTime && t - cacheTime < (time_t)(60 - tm.Second)){
+    // same minute, the usual case when time is moving forward
+    tm.Second += t - cacheTime;
+  }
+  else if( cacheValid && elapsedDays(t) == elapsedDays(cacheTime)){
+    // same day, the date stays
+    time_t secs = elapsedSecsToday(t);
+    tm.Second = secs % 60;
+    tm.Minute = (secs / 60) % 60;
+    tm.Hour = secs / 3600;
   }
+  else
+    breakTime(t, tm); 
+    
+  cacheTime = t; 
+  cacheValid = true;
 }
 
 int hour() { // the hour now 
@@ -134,60 +151,44 @@ int year(time_t t) { // the year for the given time
 /* functions to convert to and from system time */
 /* These are for interfacing with time serivces and are not normally needed in a sketch */
 
-// leap year calulator expects year argument as years offset from 1970
-#define LEAP_YEAR(Y)     ( ((1970+Y)>0) && !((1970+Y)%4) && ( ((1970+Y)%100) || !((1970+Y)%400) ) )
+// Days since 1 Jan 1970 of a date, and back. Closed form, from Howard Hinnant's 
+// days_from_civil/civil_from_days: counting years from 1 March puts the leap 
+// day at the end of the year, and months 3..14 are then 153 days per 5 months. 
+// Only dates from 1970 on are needed, so there are no negative eras.
+static long daysFromCivil(int y, uint8_t m, uint8_t d){
+  y -= m <= 2;
+  long era = y / 400;
+  unsigned int yoe = y - era * 400;                                  // [0, 399]
+  unsigned int doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1; // [0, 365]
+  long doe = yoe * 365L + yoe / 4 - yoe / 100 + doy;                 // [0, 146096]
+  return era * 146097L + doe - 719468L;
+}
 
-static  const uint8_t monthDays[]={31,28,31,30,31,30,31,31,30,31,30,31}; // API starts months from 1, this array starts from 0
+static void civilFromDays(long z, tmElements_t &tm){
+  z += 719468L;
+  long era = z / 146097L;
+  long doe = z - era * 146097L;                                           // [0, 146096]
+  unsigned int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365; // [0, 399]
+  unsigned int doy = doe - (365L * yoe + yoe / 4 - yoe / 100);             // [0, 365]
+  uint8_t mp = (5 * doy + 2) / 153;                                        // [0, 11]
+  tm.Day = doy - (153 * mp + 2) / 5 + 1;
+  tm.Month = mp < 10 ? mp + 3 : mp - 9;
+  tm.Year = CalendarYrToTm(yoe + era * 400 + (tm.Month <= 2));
+}
  
 void breakTime(time_t time, tmElements_t &tm){
 // break the given time_t into time components
 // this is a more compact version of the C library localtime function
 // note that year is offset from 1970 !!!
 
-  uint8_t year;
-  uint8_t month, monthLength;
-  unsigned long days;
-  
-  tm.Second = time % 60;
-  time /= 60; // now it is minutes
-  tm.Minute = time % 60;
-  time /= 60; // now it is hours
-  tm.Hour = time % 24;
-  time /= 24; // now it is days
-  tm.Wday = ((time + 4) % 7) + 1;  // Sunday is day 1 
-  
-  year = 0;  
-  days = 0;
-  while((unsigned)(days += (LEAP_YEAR(year) ? 366 : 365)) <= time) {
-    year++;
-  }
-  tm.Year = year; // year is offset from 1970 
+  unsigned long days = elapsedDays(time);
+  time_t secs = elapsedSecsToday(time);
   
-  days -= LEAP_YEAR(year) ? 366 : 365;
-  time  -= days; // now it is days in this year, starting at 0
-  
-  days=0;
-  month=0;
-  monthLength=0;
-  for (month=0; month<12; month++) {
-    if (month==1) { // february
-      if (LEAP_YEAR(year)) {
-        monthLength=29;
-      } else {
-        monthLength=28;
-      }
-    } else {
-      monthLength = monthDays[month];
-    }
-    
-    if (time >= monthLength) {
-      time -= monthLength;
-    } else {
-        break;
-    }
-  }
-  tm.Month = month + 1;  // jan is month 1  
-  tm.Day = time + 1;     // day of month
+  tm.Second = secs % 60;
+  tm.Minute = (secs / 60) % 60;
+  tm.Hour = secs / 3600;
+  tm.Wday = ((days + 4) % 7) + 1;  // Sunday is day 1 
+  civilFromDays(days, tm);
 }
 
 time_t makeTime(tmElements_t &tm){   
@@ -195,26 +196,9 @@ time_t makeTime(tmElements_t &tm){
 // note year argument is offset from 1970 (see macros in time.h to convert to other formats)
 // previous version used full four digit year (or digits since 2000),i.e. 2009 was 2009 or 9
   
-  int i;
   time_t seconds;
 
-  // seconds from 1970 till 1 jan 00:00:00 of the given year
-  seconds= tm.Year*(SECS_PER_DAY * 365);
-  for (i = 0; i < tm.Year; i++) {
-    if (LEAP_YEAR(i)) {
-      seconds +=  SECS_PER_DAY;   // add extra days for leap years
-    }
-  }
-  
-  // add days for this year, months start from 1
-  for (i = 1; i < tm.Month; i++) {
-    if ( (i == 2) && LEAP_YEAR(tm.Year)) { 
-      seconds += SECS_PER_DAY * 29;
-    } else {
-      seconds += SECS_PER_DAY * monthDays[i-1];  //monthDay array starts from 0
-    }
-  }
-  seconds+= (tm.Day-1) * SECS_PER_DAY;
+  seconds = daysFromCivil(tmYearToCalendar(tm.Year), tm.Month, tm.Day) * SECS_PER_DAY;
   seconds+= tm.Hour * SECS_PER_HOUR;
   seconds+= tm.Minute * SECS_PER_MIN;
   seconds+= tm.Second;
@@ -228,6 +212,14 @@ static time_t prevMillis = 0;
 static time_t nextSyncTime = 0;
 static timeStatus_t Status = timeNotSet;
 
+// seconds counted by secondTick() rather than millis(), see setSecondTicks()
+static bool tickArmed = false;   // ticks are wanted, tickDriven while they come
+static bool tickDriven = false;
+static time_t tickSyncInterval;  // syncInterval while tickDriven
+static volatile uint8_t pendingTicks = 0;     // ticks not yet added to sysTime
+static volatile unsigned long tickMillis = 0; // millis() at the last tick
+static volatile unsigned long tickGap = 0;    // millis() between the last two ticks
+
 getExternalTime getTimePtr;  // pointer to external sync function
 //setExternalTime setTimePtr; // not used in this version
 
@@ -237,17 +229,61 @@ time_t sysUnsyncedTime = 0; // the time sysTime unadjusted by sync
 
 
 time_t now(){
-  while( millis() - prevMillis >= 1000){      
-    sysTime++;
-    prevMillis += 1000;	
+  if(tickDriven){
+    uint8_t ticks;
+    
+    noInterrupts();
+    ticks = pendingTicks;
+    pendingTicks = 0;
+    if(ticks)
+      prevMillis = tickMillis;  // the second started at the tick
+    interrupts();
+    
+    sysTime += ticks;
+#ifdef TIME_DRIFT_INFO
+    sysUnsyncedTime += ticks;
+#endif	
+    if(millis() - prevMillis > 2000){
+      // the ticks stopped, carry on counting millis() and sync as often as
+      // without them
+      tickDriven = false;
+      nextSyncTime = sysTime;
+    }
+  }
+  else if(tickArmed && pendingTicks){
+    // back to the ticks once they come a second apart again
+    noInterrupts();
+    bool steady = tickGap > 900 && tickGap < 1100;
+    pendingTicks = 0;
+    if(steady)
+      prevMillis = tickMillis;
+    interrupts();
+    
+    if(steady){
+      tickDriven = true;
+      nextSyncTime = sysTime;  // take the time from the clock again
+    }
+  }
+  if(!tickDriven){
+    while( millis() - prevMillis >= 1000){      
+      sysTime++;
+      prevMillis += 1000;	
 #ifdef TIME_DRIFT_INFO
-    sysUnsyncedTime++; // this can be compared to the synced time to measure long term drift     
+      sysUnsyncedTime++; // this can be compared to the synced time to measure long term drift     
 #endif	
+    }
   }
-  if(nextSyncTime <= sysTime){
+  // with ticks, only sync in the first half of a second so the clock being 
+  // read cannot be on the other side of a tick from sysTime
+  if(nextSyncTime <= sysTime && (!tickDriven || millis() - prevMillis < 500)){
 	if(getTimePtr != 0){
 	  time_t t = getTimePtr();
-      if( t != 0)
+      if( t == sysTime){
+        // the clocks agree to the second, keep the sub-second phase
+        nextSyncTime = t + (tickDriven ? tickSyncInterval : syncInterval);
+        Status = timeSet;
+      }
+      else if( t != 0)
         setTime(t);
       else
         Status = (Status == timeNotSet) ?  timeNotSet : timeNeedsSync;        
@@ -256,6 +292,14 @@ time_t now(){
   return sysTime;
 }
 
+time_t now(unsigned int &ms){
+  time_t t = now();
+  ms = millis() - prevMillis;  // milliseconds into second t
+  if(ms > 999)
+    ms = 999;  // a second has just passed, the next call to now() counts it
+  return t;
+}
+
 void setTime(time_t t){ 
 #ifdef TIME_DRIFT_INFO
  if(sysUnsyncedTime == 0) 
@@ -263,11 +307,30 @@ void setTime(time_t t){
 #endif
 
   sysTime = t;  
-  nextSyncTime = t + syncInterval;
+  nextSyncTime = t + (tickDriven ? tickSyncInterval : syncInterval);
   Status = timeSet; 
-  prevMillis = millis();  // restart counting from now (thanks to Korman for this fix)
+  if(!tickDriven)
+    prevMillis = millis();  // restart counting from now (thanks to Korman for this fix)
 } 
 
+void secondTick(){
+  unsigned long m = millis();
+  
+  pendingTicks++;
+  tickGap = m - tickMillis;
+  tickMillis = m;
+}
+
+void setSecondTicks(bool enable, time_t interval){
+  noInterrupts();
+  pendingTicks = 0;
+  interrupts();
+  tickArmed = enable;
+  tickDriven = enable;
+  tickSyncInterval = interval ? interval : syncInterval;
+  nextSyncTime = sysTime;  // take the time from the clock again at the next tick
+}
+
 void  setTime(int hr,int min,int sec,int dy, int mnth, int yr){
  // year can be given as full four digit year or two digts (2010 or 10 for 2010);  
  //it is converted to years since 1970
@@ -91,6 +91,7 @@ int     year();            // the full four digit year: (2009, 2010 etc)
 int     year(time_t t);    // the year for the given time
 
 time_t now();              // return the current time as seconds since Jan 1 1970 
+time_t now(unsigned int &ms); // as now(), also setting ms to the milliseconds into that second
 void    setTime(time_t t);
 void    setTime(int hr,int min,int sec,int day, int month, int yr);
 void    adjustTime(long adjustment);
@@ -106,6 +107,8 @@ char* dayShortStr(uint8_t day);
 timeStatus_t timeStatus(); // indicates if time has been set and recently synchronized
 void    setSyncProvider( getExternalTime getTimeFunction); // identify the external time provider
 void    setSyncInterval(time_t interval); // set the number of seconds between re-sync
+void    secondTick();      // call from a 1 Hz interrupt that marks the start of each second of the sync provider's clock
+void    setSecondTicks(bool enable, time_t interval = 0); // count seconds with secondTick() rather than millis(), re-syncing every interval seconds (0 for the setSyncInterval() one); falls back to millis() and setSyncInterval() by itself if the ticks stop, and returns to the ticks when they come back
 
 /* low level functions to convert to and from system time                     */
 void breakTime(time_t time, tmElements_t &tm);  // break time_t into elements
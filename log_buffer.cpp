@@ -0,0 +1,54 @@
+/****
+ * Arduino Power Meter Reader (APMR)
+ * Copyright (C) 2010-2012 Stephen Makonin and contributors. All rights reserved.
+ * This project is here by released under the COMMON DEVELOPMENT AND DISTRIBUTION LICENSE (CDDL).
+ */
+
+#include "log_buffer.h"
+
+LogBuffer::LogBuffer(log_sink sink)
+{
+  this->sink = sink;
+  len = 0;
+}
+
+size_t LogBuffer::write(uint8_t c)
+{
+  if(len == LOG_BUFFER_SIZE)
+    write_back();
+    
+  buf[len++] = c;
+  return 1;
+}
+
+size_t LogBuffer::write(const uint8_t *data, size_t size)
+{
+  size_t left = size;
+  
+  while(left)
+  {
+    if(len == LOG_BUFFER_SIZE)
+      write_back();
+      
+    word n = min(left, (size_t)(LOG_BUFFER_SIZE - len));
+    memcpy(&buf[len], data, n);
+    len += n;
+    data += n;
+    left -= n;
+  }
+  
+  return size;
+}
+
+// Hand everything buffered to the sink
+void LogBuffer::write_back()
+{
+  if(len)
+    sink(buf, len);
+  len = 0;
+}
+
+word LogBuffer::length()
+{
+  return len;
+}
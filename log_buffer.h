@@ -0,0 +1,36 @@
+/****
+ * Arduino Power Meter Reader (APMR)
+ * Copyright (C) 2010-2012 Stephen Makonin and contributors. All rights reserved.
+ * This project is here by released under the COMMON DEVELOPMENT AND DISTRIBUTION LICENSE (CDDL).
+ */
+
+// Write-back buffer for the SD card logs. Records are printed into RAM and
+// handed to the sink a full buffer at a time, or when write_back() is called.
+ 
+#ifndef log_buffer_h
+#define log_buffer_h
+
+#include <Arduino.h>
+
+#define LOG_BUFFER_SIZE 512 // one SD card sector
+
+typedef void (*log_sink)(const uint8_t *data, word len);
+
+class LogBuffer : public Print
+{
+  public:
+    LogBuffer(log_sink sink);
+    size_t write(uint8_t c);
+    size_t write(const uint8_t *data, size_t size);
+    using Print::write;
+    
+    void write_back();
+    word length();
+    
+  private:
+    log_sink sink;
+    uint8_t buf[LOG_BUFFER_SIZE];
+    word len;
+};
+
+#endif
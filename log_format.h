@@ -0,0 +1,135 @@
+/****
+ * Arduino Power Meter Reader (APMR)
+ * Copyright (C) 2010-2012 Stephen Makonin and contributors. All rights reserved.
+ * This project is here by released under the COMMON DEVELOPMENT AND DISTRIBUTION LICENSE (CDDL).
+ */
+
+// Binary format of the daily logs (YYYY/MM/DD.bin). Shared with
+// tools/log2json.cpp, which turns them back into the JSON lines the web
+// service gets.
+//
+// A file is a series of blocks, each starting with a tag byte:
+//
+//   header: log_header, then meter_count log_meter entries. Written when the
+//           file is opened, so the meter table after a reset is always the
+//           one in force for the records that follow.
+//   record: log_record, then for each meter in the table measure_count
+//           floats (power, energy: the order of measure_types[]) and, if
+//           the header has LOG_FLAG_AGGREGATE, a log_aggregate, then a
+//           LOG_RECORD_END byte.
+//
+// Alongside each DD.bin, DD.idx holds a log_index entry for the first record
+// in every LOG_INDEX_SECS of the day, and for the first record after each
+// header, so a time range can be found without reading the whole day.
+// Entries are only written once the records they point to are on the card.
+//
+// A pre-allocated log is filled with zeros ahead of time; the records end
+// at the first zero where a tag is expected. The card writes a sector at a
+// time, so a record torn by a reset can have its start on the card and its
+// end still zeros; it is told by its last byte not being LOG_RECORD_END, or
+// by its ms going back on the record before it.
+//
+// Records are fixed width for a given header, 6 bytes plus 8 per meter against
+// ~90 bytes per meter as text. Multi-byte fields are little endian (AVR and
+// x86 alike), floats IEEE 754 single precision.
+//
+// With the packed upload format the unsent journal holds the same blocks, a
+// header at the start of each segment and of each day. What is POSTed is a
+// batch (Content-Type BATCH_CONTENT_TYPE), decoded by tools/batch2json.cpp:
+// a batch_header, then blocks each starting with a tag byte:
+//
+//   table:  meter_count, measure_count and flags as in log_header, period_ms
+//           as a varint, then the meter IDs, 4 characters each. Every column
+//           starts over at 0.
+//   record: the ms since the last record (the first since base_time), then 
+//           for each meter in the table its columns: each measure as the
+//           change since the meter's last record, and with LOG_FLAG_AGGREGATE
+//           power_min and power_max less the power, samples and energy_int.
+//   end:    nothing follows, the batch is complete.
+//
+// Values are fixed point, hundredths as in the JSON (energy_int 
+// ten-thousandths), held to +/-BATCH_FIXED_MAX. Numbers are varints, 7 bits a
+// byte from the least significant with the top bit set on all but the last; 
+// signed ones are zigzag encoded (0, -1, 1, -2 as 0, 1, 2, 3) first. A meter
+// that reads much the same each time costs 2-4 bytes a record.
+
+#ifndef log_format_h
+#define log_format_h
+
+#include <stdint.h>
+
+#define LOG_MAGIC "APMR"
+#define LOG_VERSION 3
+#define LOG_TAG_HEADER 0x5A
+#define LOG_TAG_RECORD 0xA5
+#define LOG_RECORD_END 0xE5 // last byte of every record, written last
+#define LOG_FLAG_AGGREGATE 0x01 // records carry min/max/samples/energy_int
+#define LOG_INDEX_SECS 300 // one index entry per 5 minutes
+#define BATCH_MAGIC "APMB"
+#define BATCH_VERSION 1
+#define BATCH_CONTENT_TYPE "application/x-apmr-batch"
+#define BATCH_TAG_TABLE 'T'
+#define BATCH_TAG_RECORD 'R'
+#define BATCH_TAG_END 'E'
+#define BATCH_SCALE 100.0
+#define BATCH_SCALE_ENERGY_INT 10000.0
+#define BATCH_FIXED_MAX 1000000000L // so the change between two fits 32 bits
+
+typedef struct
+{
+  uint8_t tag;           // LOG_TAG_HEADER
+  char magic[4];         // LOG_MAGIC, not null terminated
+  uint8_t version;
+  uint8_t flags;
+  uint8_t meter_count;
+  uint8_t measure_count;
+  char home_id[4];       // not null terminated if 4 characters long
+  uint32_t base_time;    // midnight (UTC) of the file's day, seconds since 1970
+  uint32_t period_ms;    // read period, below 1000 the timestamps show ms
+} __attribute__((packed)) log_header;
+
+typedef struct
+{
+  char id[4];            // meter ID, not null terminated if 4 characters long
+  uint8_t modbus_id;
+  uint8_t bus;
+  uint8_t type;          // index into meter_models[]
+} __attribute__((packed)) log_meter;
+
+typedef struct
+{
+  uint8_t tag;           // LOG_TAG_RECORD
+  uint32_t ms;           // milliseconds since base_time
+} __attribute__((packed)) log_record;
+
+typedef struct
+{
+  float power_min;
+  float power_max;
+  float energy_int;
+  uint32_t samples;      // an hour of back to back reads can be more than 65535
+} __attribute__((packed)) log_aggregate;
+
+typedef struct
+{
+  uint32_t ms;           // of the record, as in log_record
+  uint32_t record;       // offset of the record in DD.bin
+  uint32_t header;       // offset of the header the record follows
+} __attribute__((packed)) log_index;
+
+typedef struct
+{
+  char magic[4];         // BATCH_MAGIC, not null terminated
+  uint8_t version;
+  char home_id[4];       // not null terminated if 4 characters long
+  uint32_t base_time;    // when the batch was made, seconds since 1970
+} __attribute__((packed)) batch_header;
+
+// Bytes of a record under header h, with its values and end byte
+static inline uint32_t log_record_size(const log_header &h)
+{
+  return sizeof(log_record) + h.meter_count * 
+         (h.measure_count * sizeof(float) + ((h.flags & LOG_FLAG_AGGREGATE) ? sizeof(log_aggregate) : 0)) + 1;
+}
+
+#endif
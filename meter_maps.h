@@ -0,0 +1,84 @@
+/****
+ * Arduino Power Meter Reader (APMR)
+ * Copyright (C) 2010-2012 Stephen Makonin and contributors. All rights reserved.
+ * This project is here by released under the COMMON DEVELOPMENT AND DISTRIBUTION LICENSE (CDDL).
+ */
+
+// Register map types for the supported meter models, the maps themselves are
+// in APMR.ino next to meter_models[]. Kept in a header so the sketch's
+// functions can take these types as arguments.
+ 
+#ifndef meter_maps_h
+#define meter_maps_h
+
+#include <Arduino.h>
+#include <ModbusMaster.h>
+
+// How a quantity is stored in the meter's registers
+#define REG_U16 ModbusMaster::MBFieldU16
+#define REG_S16 ModbusMaster::MBFieldS16
+#define REG_U32 ModbusMaster::MBFieldU32
+#define REG_S32 ModbusMaster::MBFieldS32
+#define REG_F32 ModbusMaster::MBFieldF32
+
+// Word order of the 32 bit types
+#define WORDS_HI_LO 0 // high word at the lower address (Modbus convention)
+#define WORDS_LO_HI ModbusMaster::MBWordSwap // low word at the lower address
+
+// One quantity read from a meter, the scaled value is added into
+// readings[][measure] so a negative scale subtracts (e.g. export energy)
+typedef struct
+{
+  byte measure;
+  word address;
+  byte type;
+  byte order;
+  float scale;
+} meter_register;
+
+typedef struct
+{
+  char *name;
+  const meter_register *regs;
+  byte reg_count;
+} meter_model;
+
+// One Modbus read covering one or more of a model's registers
+typedef struct
+{
+  word address;
+  byte count;
+  byte first_reg; // index into plan_regs[] and plan_fields[]
+  byte reg_count;
+} read_block;
+
+#define MAX_BLOCK_REGS 125 // Modbus limit for one read
+// A meter's usual time from the end of a request to the start of its reply,
+// spent again on every read the plan adds
+#define PLAN_TURNAROUND_MS 20
+
+// Whether block had best be stretched to take in the registers from address
+// up to end, rather than have those read on their own at baud. A separate
+// read costs ~20 byte times on the wire (8 byte request, 5 byte reply 
+// overhead and two 3.5 char gaps) plus the meter's turnaround, reading 
+// through a gap costs 2 bytes per unused register.
+inline boolean plan_joins(const read_block *block, word address, word end, long baud)
+{
+  // in bits, 11 a byte
+  long read_cost = 20 * 11 + PLAN_TURNAROUND_MS * baud / 1000;
+  long gap = (long)address - (block->address + block->count);
+  
+  return gap * 2 * 11 <= read_cost && end - block->address <= MAX_BLOCK_REGS;
+}
+
+// A register value as decoded by ModbusMaster, one per register in a read
+typedef union
+{
+  uint16_t u16;
+  int16_t s16;
+  uint32_t u32;
+  int32_t s32;
+  float f32;
+} reg_value;
+
+#endif
@@ -0,0 +1,105 @@
+/****
+ * Arduino Power Meter Reader (APMR)
+ * Copyright (C) 2010-2012 Stephen Makonin and contributors. All rights reserved.
+ * This project is here by released under the COMMON DEVELOPMENT AND DISTRIBUTION LICENSE (CDDL).
+ */
+
+// The MQTT 3.1.1 packets APMR sends, built into a caller's buffer. Plain
+// functions of their arguments, so tools/mqtt_check.cpp can hold them to
+// the bytes of the specification and to a broker.
+
+#ifndef mqtt_packet_h
+#define mqtt_packet_h
+
+#include <stdint.h>
+#include <string.h>
+
+#define MQTT_CONNECT 1     // control packet types
+#define MQTT_CONNACK 2
+#define MQTT_PUBLISH 3
+#define MQTT_PUBACK 4
+#define MQTT_PINGREQ 12
+
+// Remaining length, 7 bits a byte from the least significant with the top
+// bit set on all but the last; returns the bytes written (1 to 4)
+static inline uint8_t mqtt_put_length(uint8_t *p, uint32_t len)
+{
+  uint8_t n = 0;
+  
+  do
+  {
+    p[n] = len & 0x7F;
+    len >>= 7;
+    if(len)
+      p[n] |= 0x80;
+    n++;
+  }
+  while(len);
+  
+  return n;
+}
+
+// CONNECT for a clean session with no will, user name or password; returns
+// its bytes, 14 plus those of client_id (up to 113 of them)
+static inline uint8_t mqtt_connect(uint8_t *p, const char *client_id, uint16_t keepalive)
+{
+  uint8_t len = strlen(client_id);
+  
+  p[0] = MQTT_CONNECT << 4;
+  p[1] = 12 + len;
+  memcpy(&p[2], "\0\4MQTT\4", 7); // protocol name and level
+  p[9] = 0x02; // clean session
+  p[10] = keepalive >> 8;
+  p[11] = keepalive & 0xFF;
+  p[12] = 0;
+  p[13] = len;
+  memcpy(&p[14], client_id, len);
+  
+  return 14 + len;
+}
+
+// Bytes of a QoS 1 PUBLISH to topic before a payload of payload bytes
+static inline uint8_t mqtt_publish_head_size(const char *topic, uint16_t payload)
+{
+  uint8_t tmp[4];
+  uint16_t topic_len = strlen(topic);
+  
+  return 1 + mqtt_put_length(tmp, 2 + topic_len + 2 + payload) + 2 + topic_len + 2;
+}
+
+// The fixed header, topic and packet ID of a QoS 1 PUBLISH, which its
+// payload follows; returns the bytes written
+static inline uint8_t mqtt_publish_head(uint8_t *p, const char *topic, uint16_t id, uint16_t payload)
+{
+  uint8_t *start = p;
+  uint16_t topic_len = strlen(topic);
+  
+  *p++ = (MQTT_PUBLISH << 4) | 0x02; // QoS 1
+  p += mqtt_put_length(p, 2 + topic_len + 2 + payload);
+  *p++ = topic_len >> 8;
+  *p++ = topic_len & 0xFF;
+  memcpy(p, topic, topic_len);
+  p += topic_len;
+  *p++ = id >> 8;
+  *p++ = id & 0xFF;
+  
+  return p - start;
+}
+
+// Make a journal line of len bytes a JSON object on its own: without the
+// ",\r\n" joining it to the next reading or the ", " before its closing
+// brace. Returns its new length.
+static inline uint16_t mqtt_json_payload(char *line, uint16_t len)
+{
+  while(len && (line[len - 1] == ',' || line[len - 1] == '\r' || line[len - 1] == '\n'))
+    len--;
+  if(len >= 3 && line[len - 1] == '}' && line[len - 2] == ' ' && line[len - 3] == ',')
+  {
+    line[len - 3] = '}';
+    len -= 2;
+  }
+
+  return len;
+}
+
+#endif
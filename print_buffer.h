@@ -0,0 +1,44 @@
+/****
+ * Arduino Power Meter Reader (APMR)
+ * Copyright (C) 2010-2012 Stephen Makonin and contributors. All rights reserved.
+ * This project is here by released under the COMMON DEVELOPMENT AND DISTRIBUTION LICENSE (CDDL).
+ */
+
+// Print through a caller's buffer: text printed a few characters at a time
+// reaches out (usually an EthernetClient, where every write is a packet) a
+// full buffer at a time, or when flush() is called.
+
+#ifndef print_buffer_h
+#define print_buffer_h
+
+#include <Arduino.h>
+
+class PrintBuffer : public Print
+{
+  public:
+    PrintBuffer(Print &out, uint8_t *buf, word size) : out(out), buf(buf), size(size), len(0) {}
+
+    size_t write(uint8_t c)
+    {
+      if(len == size)
+        flush();
+      buf[len++] = c;
+      return 1;
+    }
+    using Print::write;
+
+    void flush()
+    {
+      if(len)
+        out.write(buf, len);
+      len = 0;
+    }
+
+  private:
+    Print &out;
+    uint8_t *buf;
+    word size;
+    word len;
+};
+
+#endif
@@ -0,0 +1,36 @@
+/****
+ * Arduino Power Meter Reader (APMR)
+ * Copyright (C) 2010-2012 Stephen Makonin and contributors. All rights reserved.
+ * This project is here by released under the COMMON DEVELOPMENT AND DISTRIBUTION LICENSE (CDDL).
+ */
+
+// Block copy from a file to a socket (or anything else with read(buf, n) and
+// write(buf, n)): one SD read and one socket write per buffer instead of per
+// byte. A template so tools/stream_bench.cpp can run it against stand-ins.
+ 
+#ifndef stream_copy_h
+#define stream_copy_h
+
+#define STREAM_BUFFER_SIZE 512 // one SD card sector
+
+// Copy up to limit bytes (by default the rest) of src to dst through buf,
+// returns the bytes written
+template <class Source, class Sink>
+unsigned long stream_copy(Source &src, Sink &dst, uint8_t *buf, uint16_t size, unsigned long limit = 0xFFFFFFFFUL)
+{
+  unsigned long total = 0;
+  int n;
+  
+  while(total < limit && (n = src.read(buf, limit - total < size ? (uint16_t)(limit - total) : size)) > 0)
+  {
+    size_t written = dst.write(buf, n);
+    
+    total += written;
+    if(written != (size_t)n)
+      break;
+  }
+  
+  return total;
+}
+
+#endif
@@ -0,0 +1,218 @@
+/*
+ batch2json.cpp - decode the packed batches APMR posts with the packed upload
+ format (Content-Type application/x-apmr-batch, format in log_format.h) into
+ the JSON lines the board would have sent instead
+
+ Build on Linux:
+
+   g++ -O2 -I.. batch2json.cpp -o batch2json
+
+ Usage:
+
+   ./batch2json batch.bin [more batches...] > readings.json
+   ./batch2json -s < batch.bin
+
+ A web service can hand each body it is posted to this as it is, or follow
+ it for its own decoder. Each batch must run to its end tag, anything else
+ is an error, so it doubles as a check of what the board sends. With -s the
+ size of each batch against the JSON it stands for goes to stderr.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "log_format.h"
+
+#define MAX_BATCH_METERS 255
+#define MAX_BATCH_MEASURES 2
+
+static const char *measure_types[] = { "power", "energy" };
+
+struct reader
+{
+  FILE *in;
+  long bytes;
+};
+
+static int get_byte(reader &r)
+{
+  int c = fgetc(r.in);
+
+  if(c != EOF)
+    r.bytes++;
+  return c;
+}
+
+// Read a varint, returns false if the batch ends in it
+static bool get_varint(reader &r, uint64_t &v)
+{
+  v = 0;
+  for(int shift = 0; shift < 64; shift += 7)
+  {
+    int c = get_byte(r);
+
+    if(c == EOF)
+      return false;
+    v |= (uint64_t)(c & 0x7F) << shift;
+    if(!(c & 0x80))
+      return true;
+  }
+  return false;
+}
+
+static bool get_svarint(reader &r, int64_t &v)
+{
+  uint64_t u;
+
+  if(!get_varint(r, u))
+    return false;
+  v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+  return true;
+}
+
+// Print the readings of one batch, returns 0 if it was whole
+static int convert(FILE *in, const char *name, bool stats)
+{
+  reader r = { in, 0 };
+  batch_header b;
+  uint8_t meter_count = 0, measure_count = 0, flags = 0;
+  uint64_t period_ms = 0;
+  char ids[MAX_BATCH_METERS][4];
+  int64_t cols[MAX_BATCH_METERS][MAX_BATCH_MEASURES];
+  bool have_table = false;
+  int64_t time_ms;
+  long json_bytes = 0, readings = 0;
+  int tag;
+
+  if(fread(&b, sizeof(b), 1, in) != 1 || memcmp(b.magic, BATCH_MAGIC, sizeof(b.magic)) || b.version != BATCH_VERSION)
+  {
+    fprintf(stderr, "%s: not a packed batch\n", name);
+    return 1;
+  }
+  r.bytes = sizeof(b);
+  time_ms = (int64_t)b.base_time * 1000;
+
+  while((tag = get_byte(r)) != EOF)
+  {
+    if(tag == BATCH_TAG_END)
+    {
+      if(get_byte(r) != EOF)
+      {
+        fprintf(stderr, "%s: data after the end of the batch\n", name);
+        return 1;
+      }
+      if(stats)
+        fprintf(stderr, "%s: home %.4s, %ld readings in %ld bytes, %ld as JSON (%.1f times the size)\n",
+                name, b.home_id, readings, r.bytes, json_bytes, r.bytes ? (double)json_bytes / r.bytes : 0.0);
+      return 0;
+    }
+    else if(tag == BATCH_TAG_TABLE)
+    {
+      int c1 = get_byte(r), c2 = get_byte(r), c3 = get_byte(r);
+
+      if(c3 == EOF || !get_varint(r, period_ms))
+        break;
+      meter_count = c1;
+      measure_count = c2;
+      flags = c3;
+      if(measure_count > MAX_BATCH_MEASURES)
+      {
+        fprintf(stderr, "%s: %d measures a meter is more than this knows\n", name, measure_count);
+        return 1;
+      }
+      if(fread(ids, 4, meter_count, in) != meter_count)
+        break;
+      r.bytes += 4 * meter_count;
+      memset(cols, 0, sizeof(cols));
+      have_table = true;
+    }
+    else if(tag == BATCH_TAG_RECORD && have_table)
+    {
+      int64_t dt;
+      char ts[32];
+
+      if(!get_svarint(r, dt))
+        break;
+      time_ms += dt;
+
+      time_t secs = time_ms / 1000;
+      struct tm tm;
+      gmtime_r(&secs, &tm);
+      size_t len = strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", &tm);
+      if(period_ms < 1000)
+        snprintf(ts + len, sizeof(ts) - len, ".%03u", (unsigned)(time_ms % 1000));
+
+      for(int i = 0; i < meter_count; i++)
+      {
+        int64_t min, max, energy_int;
+        uint64_t samples;
+        char line[256];
+        int n;
+
+        for(int j = 0; j < measure_count; j++)
+        {
+          int64_t d;
+
+          if(!get_svarint(r, d))
+            goto cut_short;
+          cols[i][j] += d;
+        }
+        if((flags & LOG_FLAG_AGGREGATE) &&
+           (!get_svarint(r, min) || !get_svarint(r, max) || !get_varint(r, samples) || !get_svarint(r, energy_int)))
+          goto cut_short;
+
+        n = snprintf(line, sizeof(line), "{\"meter\": \"%.4s\", \"ts\": \"%s UTC\", ", ids[i], ts);
+        for(int j = 0; j < measure_count; j++)
+          n += snprintf(line + n, sizeof(line) - n, "\"%s\": %.2f, ", measure_types[j], cols[i][j] / BATCH_SCALE);
+        if(flags & LOG_FLAG_AGGREGATE)
+          n += snprintf(line + n, sizeof(line) - n, "\"power_min\": %.2f, \"power_max\": %.2f, \"samples\": %u, \"energy_int\": %.4f, ",
+                        (cols[i][0] + min) / BATCH_SCALE, (cols[i][0] + max) / BATCH_SCALE, (unsigned)samples, energy_int / BATCH_SCALE_ENERGY_INT);
+        n += snprintf(line + n, sizeof(line) - n, "},\r\n");
+        fputs(line, stdout);
+        json_bytes += n;
+        readings++;
+      }
+    }
+    else
+    {
+      fprintf(stderr, "%s: unexpected byte 0x%02X at offset %ld\n", name, tag, r.bytes - 1);
+      return 1;
+    }
+  }
+
+cut_short:
+  fprintf(stderr, "%s: batch cut short at offset %ld\n", name, r.bytes);
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  bool stats = false;
+  int failed = 0;
+  int first = 1;
+
+  if(argc > 1 && !strcmp(argv[1], "-s"))
+  {
+    stats = true;
+    first++;
+  }
+  if(first == argc)
+    return convert(stdin, "stdin", stats);
+
+  for(int i = first; i < argc; i++)
+  {
+    FILE *in = fopen(argv[i], "rb");
+
+    if(!in)
+    {
+      perror(argv[i]);
+      failed = 1;
+      continue;
+    }
+    failed |= convert(in, argv[i], stats);
+    fclose(in);
+  }
+
+  return failed;
+}
@@ -0,0 +1,71 @@
+/*
+ Arduino.h - just enough of the Arduino core to build APMR's libraries on
+ a Linux host for the benchmarks and checks in tools/. The tool supplies
+ millis() and micros(), and Serial if it uses ModbusMaster.
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the Time library has its own 32 bit time_t; keep it apart from the C library's
+#define time_t arduino_time_t
+
+typedef uint8_t byte;
+typedef bool boolean;
+typedef unsigned int word;
+
+unsigned long millis(void);
+unsigned long micros(void);
+
+#define noInterrupts()
+#define interrupts()
+
+#define lowByte(w) ((uint8_t)((w) & 0xFF))
+#define highByte(w) ((uint8_t)((w) >> 8))
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+static inline word makeWord(uint8_t h, uint8_t l)
+{
+  return (h << 8) | l;
+}
+#define word(...) makeWord(__VA_ARGS__)
+
+class Print
+{
+  public:
+    virtual size_t write(uint8_t) = 0;
+    virtual size_t write(const uint8_t *buf, size_t size)
+    {
+      size_t n = 0;
+
+      while(size--)
+        n += write(*buf++);
+      return n;
+    }
+};
+
+class Stream : public Print
+{
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual void flush() = 0;
+};
+
+// a serial port is whatever the tool makes of it
+class HardwareSerial : public Stream
+{
+  public:
+    virtual void begin(unsigned long) {}
+};
+
+extern HardwareSerial &Serial;
+
+#endif
@@ -0,0 +1,35 @@
+/*
+ IPAddress.h - the Arduino IPAddress, as far as ModbusTCPTransport uses it
+*/
+
+#ifndef IPAddress_h
+#define IPAddress_h
+
+#include "Arduino.h"
+
+class IPAddress
+{
+  private:
+    uint8_t _address[4];
+
+  public:
+    IPAddress()
+    {
+      memset(_address, 0, sizeof(_address));
+    }
+
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+    {
+      _address[0] = a;
+      _address[1] = b;
+      _address[2] = c;
+      _address[3] = d;
+    }
+
+    uint8_t operator[](int i) const
+    {
+      return _address[i];
+    }
+};
+
+#endif
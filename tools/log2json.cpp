@@ -0,0 +1,146 @@
+/*
+ log2json.cpp - expand APMR's binary daily logs (YYYY/MM/DD.bin, format in
+ log_format.h) back into the JSON lines the board sends to the web service
+
+ Build on Linux:
+
+   g++ -O2 -I.. log2json.cpp -o log2json
+
+ Usage:
+
+   ./log2json 2012/11/13.bin [more files...] > 13.json
+   ./log2json < 13.bin
+
+ The output is line for line what the board would have printed for each
+ reading. The records end at the end of the file, or where the zeros of a 
+ pre-allocated log start. A record cut short or torn by a reset while it was
+ being written ends the file with a warning; anything else unexpected is an
+ error.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "log_format.h"
+
+#define MAX_LOG_METERS 255
+#define MAX_RECORD_BODY (MAX_LOG_METERS * (2 * sizeof(float) + sizeof(log_aggregate)) + 1)
+
+static const char *measure_types[] = { "power", "energy" };
+#define MEASURE_TYPES (sizeof(measure_types) / sizeof(measure_types[0]))
+
+// Print the records of one log, returns 0 if it was read to the end
+static int convert(FILE *in, const char *name)
+{
+  log_header h;
+  log_meter meters[MAX_LOG_METERS];
+  bool have_header = false;
+  long offset = 0;
+  int tag;
+
+  while((tag = fgetc(in)) != EOF)
+  {
+    if(tag == 0)
+    {
+      // the zeros of a pre-allocated log, nothing after them
+      return 0;
+    }
+    else if(tag == LOG_TAG_HEADER)
+    {
+      h.tag = tag;
+      if(fread((uint8_t *)&h + 1, sizeof(h) - 1, 1, in) != 1 ||
+         fread(meters, sizeof(log_meter), h.meter_count, in) != h.meter_count)
+        break;
+
+      if(memcmp(h.magic, LOG_MAGIC, sizeof(h.magic)) || h.version != LOG_VERSION || h.measure_count > MEASURE_TYPES)
+      {
+        fprintf(stderr, "%s: unknown log header at offset %ld\n", name, offset);
+        return 1;
+      }
+      have_header = true;
+      offset += sizeof(h) + h.meter_count * sizeof(log_meter);
+    }
+    else if(tag == LOG_TAG_RECORD && have_header)
+    {
+      log_record r;
+      uint8_t body[MAX_RECORD_BODY];
+      size_t body_size = log_record_size(h) - sizeof(r);
+      const uint8_t *p = body;
+      char ts[32];
+
+      // the whole record is read first, so a torn one prints nothing
+      r.tag = tag;
+      if(fread((uint8_t *)&r + 1, sizeof(r) - 1, 1, in) != 1 || fread(body, 1, body_size, in) != body_size)
+        break;
+      if(body[body_size - 1] != LOG_RECORD_END)
+      {
+        fprintf(stderr, "%s: warning, last record torn at offset %ld\n", name, offset);
+        return 0;
+      }
+      offset += sizeof(r) + body_size;
+
+      time_t secs = (time_t)h.base_time + r.ms / 1000;
+      struct tm tm;
+      gmtime_r(&secs, &tm);
+      size_t len = strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", &tm);
+      if(h.period_ms < 1000)
+        snprintf(ts + len, sizeof(ts) - len, ".%03u", (unsigned)(r.ms % 1000));
+
+      for(int i = 0; i < h.meter_count; i++)
+      {
+        float values[MEASURE_TYPES];
+        log_aggregate a;
+
+        memcpy(values, p, h.measure_count * sizeof(float));
+        p += h.measure_count * sizeof(float);
+        if(h.flags & LOG_FLAG_AGGREGATE)
+        {
+          memcpy(&a, p, sizeof(a));
+          p += sizeof(a);
+        }
+
+        printf("{\"meter\": \"%.4s\", \"ts\": \"%s UTC\", ", meters[i].id, ts);
+        for(int j = 0; j < h.measure_count; j++)
+          printf("\"%s\": %.2f, ", measure_types[j], values[j]);
+        if(h.flags & LOG_FLAG_AGGREGATE)
+          printf("\"power_min\": %.2f, \"power_max\": %.2f, \"samples\": %lu, \"energy_int\": %.4f, ",
+                 a.power_min, a.power_max, (unsigned long)a.samples, a.energy_int);
+        printf("},\r\n");
+      }
+    }
+    else
+    {
+      fprintf(stderr, "%s: unexpected byte 0x%02X at offset %ld\n", name, tag, offset);
+      return 1;
+    }
+  }
+
+  if(tag != EOF)
+    fprintf(stderr, "%s: warning, last record cut short\n", name);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  int failed = 0;
+
+  if(argc < 2)
+    return convert(stdin, "stdin");
+
+  for(int i = 1; i < argc; i++)
+  {
+    FILE *in = fopen(argv[i], "rb");
+
+    if(!in)
+    {
+      perror(argv[i]);
+      failed = 1;
+      continue;
+    }
+    failed |= convert(in, argv[i]);
+    fclose(in);
+  }
+
+  return failed;
+}
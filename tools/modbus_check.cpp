@@ -0,0 +1,367 @@
+/*
+ modbus_check.cpp - drive ModbusMaster over its transports on a Linux host
+
+ Build and run on Linux:
+
+   g++ -O2 -Ihost -I../libraries/ModbusMaster modbus_check.cpp ../libraries/ModbusMaster/ModbusMaster.cpp ../libraries/ModbusMaster/ModbusTransport.cpp -o modbus_check
+   ./modbus_check
+
+ The blocking and polled calls run against ModbusLoopbackTransport:
+ reads, single and multiple writes, typed fields and exceptions. The TCP
+ transport runs against a stand-in gateway that holds its replies until
+ told to send them, so replies can come back out of order, late, for a
+ master that gave up, or not at all. An RTU slave on a fake serial port
+ answers behind line noise. The clock only moves when a check moves it.
+ Last, APMR's read planner is checked to read the ION6200 map in one go.
+*/
+
+#include <stdio.h>
+#include <stddef.h>
+#include <deque>
+#include <vector>
+#include "ModbusMaster.h"
+#include "../meter_maps.h"
+
+static int failed = 0;
+static unsigned long now_ms = 0;
+
+unsigned long millis(void)
+{
+  return now_ms;
+}
+
+unsigned long micros(void)
+{
+  return now_ms * 1000;
+}
+
+static void expect(const char *what, long got, long want)
+{
+  if(got == want)
+  {
+    printf("ok    %s\n", what);
+    return;
+  }
+
+  printf("FAIL  %s: got %ld (0x%lX), want %ld (0x%lX)\n", what, got, got, want, want);
+  failed = 1;
+}
+
+// Serial, with a slave on the far end that is handed the reply to give
+class FakeSerial : public HardwareSerial
+{
+  public:
+    std::vector<uint8_t> sent;
+    std::deque<uint8_t> reply;
+
+    size_t write(uint8_t c) { sent.push_back(c); return 1; }
+    int available() { return reply.size(); }
+    int read() { int c = reply.front(); reply.pop_front(); return c; }
+    int peek() { return reply.front(); }
+    void flush() {}
+};
+
+static FakeSerial port;
+HardwareSerial &Serial = port;
+
+// A Modbus TCP gateway in front of a register bank; it keeps each request
+// it is sent and answers one when answer() is called
+class FakeGateway : public Client
+{
+  private:
+    bool up;
+
+  public:
+    uint16_t *regs;
+    std::vector<std::vector<uint8_t> > requests;
+    std::deque<uint8_t> in;
+    int connects;
+    int writes;
+
+    FakeGateway(uint16_t *r) : up(false), regs(r), connects(0), writes(0) {}
+
+    int connect(IPAddress, uint16_t) { up = true; connects++; return 1; }
+    int connect(const char *, uint16_t) { return 0; }
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t *buf, size_t size)
+    {
+      // one request per write, as the transport sends them
+      requests.push_back(std::vector<uint8_t>(buf, buf + size));
+      writes++;
+      return size;
+    }
+    int available() { return in.size(); }
+    int read() { int c = in.front(); in.pop_front(); return c; }
+    int read(uint8_t *, size_t) { return 0; }
+    int peek() { return in.front(); }
+    void flush() {}
+    void stop() { up = false; }
+    uint8_t connected() { return up; }
+    operator bool() { return up; }
+
+    uint16_t transaction(int i) { return word(requests[i][0], requests[i][1]); }
+
+    // reply to request i, a read of holding registers
+    void answer(int i)
+    {
+      std::vector<uint8_t> &r = requests[i];
+      uint16_t address = word(r[8], r[9]);
+      uint16_t qty = word(r[10], r[11]);
+      uint16_t len = 3 + 2 * qty;
+
+      in.push_back(r[0]);
+      in.push_back(r[1]);
+      in.push_back(0);
+      in.push_back(0);
+      in.push_back(highByte(len));
+      in.push_back(lowByte(len));
+      in.push_back(r[6]);
+      in.push_back(r[7]);
+      in.push_back(2 * qty);
+      for(int j = 0; j < qty; j++)
+      {
+        in.push_back(highByte(regs[address + j]));
+        in.push_back(lowByte(regs[address + j]));
+      }
+    }
+};
+
+// Poll until the transaction is over, with the clock standing still
+static uint8_t finish(ModbusMaster &m)
+{
+  uint8_t result;
+
+  while((result = m.poll()) == ModbusMaster::MBBusy && now_ms < 100000)
+    now_ms++;
+  return result;
+}
+
+struct reading
+{
+  uint32_t energy;
+  int16_t power;
+};
+
+static const ModbusField reading_fields[] =
+{
+  { 0, ModbusMaster::MBFieldU32, offsetof(reading, energy) },
+  { 2, ModbusMaster::MBFieldS16, offsetof(reading, power) },
+};
+
+static void check_loopback()
+{
+  uint16_t bank[16];
+  uint16_t response[8], transmit[4];
+  ModbusLoopbackTransport loop(bank, 16);
+  ModbusMaster m;
+  reading r;
+
+  for(int i = 0; i < 16; i++)
+    bank[i] = 0x1100 + i;
+  m.begin(loop);
+
+  // untyped calls need a buffer attached first
+  expect("read with no response buffer attached", m.readHoldingRegisters(1, 0, 4), 0);
+  m.attachResponseBuffer(response, 8);
+  expect("readHoldingRegisters(1, 2, 4)", m.readHoldingRegisters(1, 2, 4), 0);
+  expect("  register 2", m.getResponseBuffer(0), 0x1102);
+  expect("  register 5", m.getResponseBuffer(3), 0x1105);
+  expect("readInputRegisters past the bank", m.readInputRegisters(1, 14, 4), ModbusMaster::MBIllegalDataAddress);
+  expect("readCoils, which the loopback does not serve", m.readCoils(1, 0, 8), ModbusMaster::MBIllegalFunction);
+
+  expect("writeSingleRegister(1, 7, 0xBEEF)", m.writeSingleRegister(1, 7, 0xBEEF), 0);
+  expect("  register 7", bank[7], 0xBEEF);
+
+  expect("writeMultipleRegisters with no transmit buffer", m.writeMultipleRegisters(1, 0, 2), ModbusMaster::MBIllegalDataAddress);
+  m.attachTransmitBuffer(transmit, 4);
+  m.setTransmitBuffer(0, 0x0001);
+  m.setTransmitBuffer(1, 0x86A0);
+  m.setTransmitBuffer(2, (uint16_t)-250);
+  expect("writeMultipleRegisters(1, 8, 3)", m.writeMultipleRegisters(1, 8, 3), 0);
+  expect("writeMultipleRegisters beyond the transmit buffer", m.writeMultipleRegisters(1, 8, 5), ModbusMaster::MBIllegalDataAddress);
+
+  // the same registers through the polled, typed path
+  expect("startReadHoldingRegisters(1, 8, 3, fields)", m.startReadHoldingRegisters(1, 8, 3, reading_fields, 2, &r), 0);
+  expect("  poll() until done", finish(m), 0);
+  expect("  energy as U32", r.energy, 100000);
+  expect("  power as S16", r.power, -250);
+  expect("  result()", m.result(), 0);
+}
+
+static void check_tcp()
+{
+  uint16_t bank[16];
+  uint16_t big[80];
+  FakeGateway gateway(bank);
+  ModbusTCPTransport tcp(gateway);
+  ModbusMaster m[MB_TCP_MAX_PENDING + 1];
+  reading r[MB_TCP_MAX_PENDING + 1];
+
+  for(int i = 0; i < 16; i++)
+    bank[i] = 0x2200 + i;
+  for(int i = 0; i <= MB_TCP_MAX_PENDING; i++)
+  {
+    m[i].begin(tcp);
+    m[i].setResponseTimeout(50);
+  }
+
+  // the transport leaves connecting to the sketch
+  expect("read with the connection down", m[0].startReadHoldingRegisters(1, 0, 3, reading_fields, 2, &r[0]), 0);
+  expect("  times out", m[0].poll(), ModbusMaster::MBResponseTimedOut);
+  expect("  no connect", gateway.connects, 0);
+  expect("  nothing sent", gateway.requests.size(), 0);
+  gateway.connect(IPAddress(192, 168, 1, 20), 502);
+
+  // two masters pipelined on one connection, answered last first
+  expect("start two reads on one connection", m[0].startReadHoldingRegisters(1, 0, 3, reading_fields, 2, &r[0]) |
+                                              m[1].startReadHoldingRegisters(2, 4, 3, reading_fields, 2, &r[1]), 0);
+  expect("  two requests sent", gateway.requests.size(), 2);
+  expect("  distinct transaction IDs", gateway.transaction(0) != gateway.transaction(1), 1);
+  expect("  MBAP length is unit ID and PDU", word(gateway.requests[0][4], gateway.requests[0][5]), 6);
+  expect("  unit ID", gateway.requests[1][6], 2);
+  gateway.answer(1);
+  gateway.answer(0);
+  expect("  first master waits behind the second's reply", m[0].poll(), ModbusMaster::MBBusy);
+  expect("  second master takes its reply", finish(m[1]), 0);
+  expect("  first master takes its reply", finish(m[0]), 0);
+  expect("  first master's registers", r[0].power, 0x2202);
+  expect("  second master's registers", r[1].power, 0x2206);
+
+  // one master gives up; its late reply must not reach the next one
+  gateway.requests.clear();
+  m[0].startReadHoldingRegisters(1, 0, 3, reading_fields, 2, &r[0]);
+  expect("unanswered read times out", finish(m[0]), ModbusMaster::MBResponseTimedOut);
+  m[1].startReadHoldingRegisters(2, 8, 3, reading_fields, 2, &r[1]);
+  gateway.answer(0);
+  gateway.answer(1);
+  expect("  the next read skips the stale reply", finish(m[1]), 0);
+  expect("  and gets its own registers", r[1].power, 0x220A);
+  expect("  nothing left on the connection", gateway.in.size(), 0);
+
+  // a dropped connection fails reads until the sketch reopens it
+  gateway.requests.clear();
+  gateway.stop();
+  m[0].startReadHoldingRegisters(1, 0, 3, reading_fields, 2, &r[0]);
+  expect("read after the connection drops times out", m[0].poll(), ModbusMaster::MBResponseTimedOut);
+  gateway.connect(IPAddress(192, 168, 1, 20), 502);
+  m[0].startReadHoldingRegisters(1, 0, 3, reading_fields, 2, &r[0]);
+  gateway.answer(0);
+  expect("  a read once it is reopened", finish(m[0]), 0);
+  expect("  still made no connect of its own", gateway.connects, 2);
+
+  // more transactions than the transport has room for
+  gateway.requests.clear();
+  for(int i = 0; i < MB_TCP_MAX_PENDING; i++)
+    m[i].startReadHoldingRegisters(1, i, 3, reading_fields, 2, &r[i]);
+  expect("one more read than MB_TCP_MAX_PENDING is refused",
+         m[MB_TCP_MAX_PENDING].startReadHoldingRegisters(1, 0, 3, reading_fields, 2, &r[MB_TCP_MAX_PENDING]), ModbusMaster::MBBusy);
+  gateway.answer(2);
+  expect("  a reply frees a slot", finish(m[2]), 0);
+  expect("  the waiting read goes out",
+         m[MB_TCP_MAX_PENDING].startReadHoldingRegisters(1, 0, 3, reading_fields, 2, &r[MB_TCP_MAX_PENDING]), 0);
+  for(int i = 0; i <= MB_TCP_MAX_PENDING; i++)
+    if(i != 2)
+      gateway.answer(i);
+  for(int i = 0; i <= MB_TCP_MAX_PENDING; i++)
+    if(i != 2)
+      finish(m[i]);
+  expect("  and gets its reply", r[MB_TCP_MAX_PENDING].power, 0x2202);
+
+  // a write longer than the transport's frame is not sent at all
+  gateway.writes = 0;
+  m[0].attachTransmitBuffer(big, 80);
+  expect("write of 80 registers over MB_TCP_BUFFER_SIZE", m[0].writeMultipleRegisters(1, 0, 80), ModbusMaster::MBIllegalDataAddress);
+  expect("  nothing written to the connection", gateway.writes, 0);
+  expect("  result()", m[0].result(), ModbusMaster::MBIllegalDataAddress);
+}
+
+static void check_rtu()
+{
+  ModbusMaster m;
+  reading r;
+  static const uint8_t request[] = { 0x05, 0x03, 0x00, 0x10, 0x00, 0x03, 0x05, 0x8A };
+  static const uint8_t reply[] = { 0x05, 0x03, 0x06, 0x00, 0x01, 0x86, 0xA0, 0xFF, 0x06 };
+  uint16_t crc = 0xFFFF;
+
+  m.begin(9600);
+  now_ms += 10; // past the gap between frames
+
+  // the transport drops whatever is waiting when a request goes out, so the
+  // slave answers after it
+  expect("RTU read behind line noise", m.startReadHoldingRegisters(5, 0x10, 3, reading_fields, 2, &r), 0);
+
+  // noise on the line ahead of the slave ID, as after the driver turns around
+  port.reply.push_back(0x00);
+  port.reply.push_back(0xFF);
+  for(unsigned i = 0; i < sizeof(reply); i++)
+  {
+    port.reply.push_back(reply[i]);
+    crc = crc16Update(crc, reply[i]);
+  }
+  port.reply.push_back(lowByte(crc));
+  port.reply.push_back(highByte(crc));
+
+  expect("  poll() until done", finish(m), 0);
+  expect("  request as sent", port.sent.size() == sizeof(request) && !memcmp(&port.sent[0], request, sizeof(request)), 1);
+  expect("  energy", r.energy, 100000);
+  expect("  power", r.power, -250);
+
+  now_ms += 10;
+  expect("RTU reply with a bad CRC", m.startReadHoldingRegisters(5, 0x10, 1, reading_fields, 1, &r), 0);
+  port.reply.push_back(0x05);
+  port.reply.push_back(0x03);
+  port.reply.push_back(0x02);
+  port.reply.push_back(0x00);
+  port.reply.push_back(0x01);
+  port.reply.push_back(0x00);
+  port.reply.push_back(0x00);
+  expect("  poll() until done", finish(m), ModbusMaster::MBInvalidCRC);
+}
+
+// The ION6200's registers, as in APMR.ino's ion6200_regs[]: kW total at
+// 119, kWh import and export at 137 and 139
+static void check_plan()
+{
+  static const long bauds[] = { 9600, 19200, 38400, 57600, 115200 };
+  static const uint16_t address[] = { 119, 137, 139 };
+  static const uint8_t width[] = { 1, 2, 2 };
+
+  // one read of 119 to 140 is what APMR made before it had a planner
+  for(unsigned b = 0; b < sizeof(bauds) / sizeof(bauds[0]); b++)
+  {
+    read_block block = { address[0], width[0], 0, 1 };
+    int reads = 1;
+    char what[64];
+
+    for(int r = 1; r < 3; r++)
+    {
+      uint16_t end = address[r] + width[r];
+
+      if(plan_joins(&block, address[r], end, bauds[b]))
+      {
+        block.count = end - block.address;
+        block.reg_count++;
+      }
+      else
+      {
+        block.address = address[r];
+        block.count = width[r];
+        reads++;
+      }
+    }
+
+    snprintf(what, sizeof(what), "ION6200 plan at %ld baud, reads", bauds[b]);
+    expect(what, reads, 1);
+  }
+}
+
+int main()
+{
+  check_loopback();
+  check_tcp();
+  check_rtu();
+  check_plan();
+
+  printf(failed ? "FAILED\n" : "all ok\n");
+  return failed;
+}
@@ -0,0 +1,257 @@
+/*
+ mqtt_check.cpp - check the MQTT 3.1.1 packets APMR builds (mqtt_packet.h)
+ against the specification, and optionally against a broker
+
+ Build and run on Linux:
+
+   g++ -O2 -I.. mqtt_check.cpp -o mqtt_check
+   ./mqtt_check
+   ./mqtt_check localhost 1883
+
+ Without arguments the remaining length encoding is held to the examples in
+ section 2.2.3 of the specification, and CONNECT and PUBLISH to the bytes
+ sections 3.1 and 3.3 lay out for them. Given a broker (e.g. mosquitto -v)
+ it also connects as the board does, publishes readings at QoS 1 and waits
+ for the CONNACK and a PUBACK for each; subscribe to apmr/# to see them
+ arrive as JSON objects.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "mqtt_packet.h"
+
+static int failed = 0;
+
+static void expect(const char *what, const uint8_t *got, int got_len, const uint8_t *want, int want_len)
+{
+  if(got_len == want_len && !memcmp(got, want, want_len))
+  {
+    printf("ok    %s\n", what);
+    return;
+  }
+
+  printf("FAIL  %s\n  got ", what);
+  for(int i = 0; i < got_len; i++)
+    printf(" %02X", got[i]);
+  printf("\n  want");
+  for(int i = 0; i < want_len; i++)
+    printf(" %02X", want[i]);
+  printf("\n");
+  failed = 1;
+}
+
+static void check_packets()
+{
+  uint8_t buf[64];
+  int n;
+
+  // 2.2.3, the smallest and largest value of each length of encoding
+  static const struct { uint32_t value; uint8_t bytes[4]; int len; } lengths[] =
+  {
+    { 0, { 0x00 }, 1 },
+    { 127, { 0x7F }, 1 },
+    { 128, { 0x80, 0x01 }, 2 },
+    { 16383, { 0xFF, 0x7F }, 2 },
+    { 16384, { 0x80, 0x80, 0x01 }, 3 },
+    { 2097151, { 0xFF, 0xFF, 0x7F }, 3 },
+    { 2097152, { 0x80, 0x80, 0x80, 0x01 }, 4 },
+    { 268435455, { 0xFF, 0xFF, 0xFF, 0x7F }, 4 },
+  };
+  for(unsigned i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+  {
+    char what[48];
+
+    snprintf(what, sizeof(what), "remaining length %lu", (unsigned long)lengths[i].value);
+    n = mqtt_put_length(buf, lengths[i].value);
+    expect(what, buf, n, lengths[i].bytes, lengths[i].len);
+  }
+
+  // 3.1: fixed header, protocol name, level 4, clean session, keep alive,
+  // then the client ID as the whole payload
+  static const uint8_t connect[] =
+  {
+    0x10, 0x13,
+    0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04, 0x02, 0x01, 0x2C,
+    0x00, 0x07, 'a', 'p', 'm', 'r', '-', 'H', '1'
+  };
+  n = mqtt_connect(buf, "apmr-H1", 300);
+  expect("CONNECT apmr-H1, keep alive 300", buf, n, connect, sizeof(connect));
+
+  // 3.3: QoS 1 in the fixed header, topic name, packet ID, payload
+  static const uint8_t publish[] =
+  {
+    0x32, 0x11,
+    0x00, 0x0A, 'a', 'p', 'm', 'r', '/', 'H', '1', '/', 'M', '1', 0x02, 0x01
+  };
+  n = mqtt_publish_head(buf, "apmr/H1/M1", 513, 3);
+  expect("PUBLISH apmr/H1/M1, ID 513, 3 byte payload", buf, n, publish, sizeof(publish));
+  if(mqtt_publish_head_size("apmr/H1/M1", 3) != n)
+  {
+    printf("FAIL  mqtt_publish_head_size() says %d\n", mqtt_publish_head_size("apmr/H1/M1", 3));
+    failed = 1;
+  }
+
+  static const uint8_t publish_long[] =
+  {
+    0x32, 0xC8, 0x01,
+    0x00, 0x0A, 'a', 'p', 'm', 'r', '/', 'H', '1', '/', 'M', '1', 0xFF, 0xFE
+  };
+  n = mqtt_publish_head(buf, "apmr/H1/M1", 0xFFFE, 200 - 14);
+  expect("PUBLISH apmr/H1/M1, ID 65534, 186 byte payload", buf, n, publish_long, sizeof(publish_long));
+  if(mqtt_publish_head_size("apmr/H1/M1", 200 - 14) != n)
+  {
+    printf("FAIL  mqtt_publish_head_size() says %d\n", mqtt_publish_head_size("apmr/H1/M1", 200 - 14));
+    failed = 1;
+  }
+
+  // a journal line as the board writes it, and as it is published
+  static const char *lines[][2] =
+  {
+    {
+      "{\"meter\": \"M1\", \"ts\": \"2012-11-13 00:00:00 UTC\", \"power\": 1.60, \"energy\": 917.00, },\r\n",
+      "{\"meter\": \"M1\", \"ts\": \"2012-11-13 00:00:00 UTC\", \"power\": 1.60, \"energy\": 917.00}"
+    },
+    {
+      "{\"meter\": \"M2\", \"ts\": \"2012-11-13 00:00:00.500 UTC\", \"power\": 1.60, \"energy\": 917.00, "
+      "\"power_min\": 1.00, \"power_max\": 2.00, \"samples\": 7, \"energy_int\": 0.1234, },\r\n",
+      "{\"meter\": \"M2\", \"ts\": \"2012-11-13 00:00:00.500 UTC\", \"power\": 1.60, \"energy\": 917.00, "
+      "\"power_min\": 1.00, \"power_max\": 2.00, \"samples\": 7, \"energy_int\": 0.1234}"
+    },
+  };
+  for(unsigned i = 0; i < sizeof(lines) / sizeof(lines[0]); i++)
+  {
+    char line[256];
+
+    strcpy(line, lines[i][0]);
+    n = mqtt_json_payload(line, strlen(line));
+    expect("journal line as a JSON object", (const uint8_t *)line, n, (const uint8_t *)lines[i][1], strlen(lines[i][1]));
+  }
+}
+
+// Read one packet from the broker, its type and up to size bytes of the rest
+// into body; returns the length of the rest, -1 if nothing came in time
+static long read_packet(int fd, int &type, uint8_t *body, int size)
+{
+  uint8_t c;
+  long len = 0;
+  int shift = 0;
+
+  if(read(fd, &c, 1) != 1)
+    return -1;
+  type = c >> 4;
+  do
+  {
+    if(read(fd, &c, 1) != 1)
+      return -1;
+    len |= (long)(c & 0x7F) << shift;
+    shift += 7;
+  }
+  while(c & 0x80);
+
+  for(long i = 0; i < len; i++)
+  {
+    if(read(fd, &c, 1) != 1)
+      return -1;
+    if(i < size)
+      body[i] = c;
+  }
+  return len;
+}
+
+static void check_broker(const char *host, const char *port)
+{
+  struct addrinfo hints, *addr;
+  struct timeval timeout = { 5, 0 };
+  uint8_t buf[512], body[4];
+  static const uint16_t first_id = 513;
+  static const int count = 3;
+  bool acked[count] = { false };
+  int fd, type, n;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  if(getaddrinfo(host, port, &hints, &addr) ||
+     (fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)) < 0 ||
+     connect(fd, addr->ai_addr, addr->ai_addrlen))
+  {
+    printf("FAIL  unable to connect to %s port %s\n", host, port);
+    failed = 1;
+    return;
+  }
+  freeaddrinfo(addr);
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  n = mqtt_connect(buf, "apmr-H1", 300);
+  if(write(fd, buf, n) != n || read_packet(fd, type, body, sizeof(body)) != 2 || type != MQTT_CONNACK || body[1])
+  {
+    printf("FAIL  broker did not take the CONNECT\n");
+    failed = 1;
+    close(fd);
+    return;
+  }
+  printf("ok    CONNACK from %s\n", host);
+
+  // written back to back, as the board writes a sector of them at a time
+  n = 0;
+  for(int i = 0; i < count; i++)
+  {
+    char line[256];
+    char topic[16];
+    uint16_t payload;
+
+    snprintf(line, sizeof(line), "{\"meter\": \"M%d\", \"ts\": \"2012-11-13 00:00:00 UTC\", \"power\": %d.00, \"energy\": 917.00, },\r\n", i + 1, 100 * i);
+    snprintf(topic, sizeof(topic), "apmr/H1/M%d", i + 1);
+    payload = mqtt_json_payload(line, strlen(line));
+    n += mqtt_publish_head(&buf[n], topic, first_id + i, payload);
+    memcpy(&buf[n], line, payload);
+    n += payload;
+  }
+  if(write(fd, buf, n) != n)
+  {
+    printf("FAIL  unable to publish\n");
+    failed = 1;
+  }
+
+  for(int i = 0; i < count; i++)
+  {
+    if(read_packet(fd, type, body, sizeof(body)) != 2 || type != MQTT_PUBACK)
+    {
+      printf("FAIL  %d of %d publishes acknowledged\n", i, count);
+      failed = 1;
+      break;
+    }
+
+    int id = ((body[0] << 8) | body[1]) - first_id;
+
+    if(id < 0 || id >= count || acked[id])
+    {
+      printf("FAIL  unexpected PUBACK ID %d\n", id + first_id);
+      failed = 1;
+      break;
+    }
+    acked[id] = true;
+    printf("ok    PUBACK %d\n", id + first_id);
+  }
+
+  buf[0] = 0xE0; // DISCONNECT
+  buf[1] = 0;
+  if(write(fd, buf, 2) != 2)
+    failed = 1;
+  close(fd);
+}
+
+int main(int argc, char **argv)
+{
+  check_packets();
+  if(argc > 1)
+    check_broker(argv[1], argc > 2 ? argv[2] : "1883");
+
+  printf(failed ? "FAILED\n" : "all ok\n");
+  return failed;
+}
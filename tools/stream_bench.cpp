@@ -0,0 +1,127 @@
+/*
+ stream_bench.cpp - host benchmark for the SD to socket copy in stream_copy.h
+ 
+ Copies a month of daily logs' worth of data (4 MB) from a file stand-in to 
+ a socket stand-in, byte by byte the way send_file() and send_data() used 
+ to, and with stream_copy(), and checks the copies are identical.
+ 
+ Build and run on Linux:
+ 
+   g++ -O2 -I.. stream_bench.cpp -o stream_bench
+   ./stream_bench
+ 
+ The host time only shows the call overhead of the byte loop. What matters 
+ on the board is the number of calls: each EthernetClient::write() is a 
+ W5100 SEND command, i.e. a packet, and each File::read() goes through the 
+ SD library's block cache. The estimate below multiplies the call counts by 
+ rough per-call and per-byte costs for a 16 MHz ATmega with 8 MHz SPI; 
+ adjust them to measurements if you have them.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "stream_copy.h"
+
+// rough costs on the board, microseconds
+#define SD_CALL_US      6.0   // File::read() bookkeeping
+#define SD_BYTE_US      0.6   // SPI transfer and cache copy
+#define SOCK_CALL_US    90.0  // free space check, pointer update, SEND and wait
+#define SOCK_BYTE_US    2.2   // W5100 write: 4 SPI bytes per data byte
+
+// the real calls are in other translation units and are not inlined
+#define CALL __attribute__((noinline))
+
+// SD card file stand-in
+class FileStandIn
+{
+  public:
+    FileStandIn(const uint8_t *data, unsigned long size) : data(data), size(size), pos(0), calls(0) {}
+    
+    CALL int available() { calls++; return pos < size; }
+    CALL int read() { calls++; return pos < size ? data[pos++] : -1; }
+    
+    CALL int read(void *buf, uint16_t n)
+    {
+      calls++;
+      if(n > size - pos)
+        n = size - pos;
+      memcpy(buf, data + pos, n);
+      pos += n;
+      return n;
+    }
+    
+    const uint8_t *data;
+    unsigned long size, pos, calls;
+};
+
+// W5100 socket stand-in
+class SocketStandIn
+{
+  public:
+    SocketStandIn(uint8_t *out) : out(out), len(0), calls(0) {}
+    
+    CALL size_t write(uint8_t c) { calls++; out[len++] = c; return 1; }
+    CALL size_t write(const uint8_t *buf, size_t n) { calls++; memcpy(out + len, buf, n); len += n; return n; }
+    
+    uint8_t *out;
+    unsigned long len, calls;
+};
+
+static double now_sec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, double secs, FileStandIn &fp, SocketStandIn &sock)
+{
+  double board = fp.calls * SD_CALL_US + fp.size * SD_BYTE_US + sock.calls * SOCK_CALL_US + sock.len * SOCK_BYTE_US;
+  
+  printf("%-12s host %7.2f ms  file calls %8lu  socket writes %8lu  board estimate %7.1f s\n", 
+         name, secs * 1e3, fp.calls, sock.calls, board / 1e6);
+}
+
+int main()
+{
+  const unsigned long size = 4UL * 1024 * 1024;
+  uint8_t *data = (uint8_t *)malloc(size);
+  uint8_t *out1 = (uint8_t *)malloc(size);
+  uint8_t *out2 = (uint8_t *)malloc(size);
+  uint8_t buf[STREAM_BUFFER_SIZE];
+  double t0, t1;
+  
+  srand(1);
+  for(unsigned long i = 0; i < size; i++)
+    data[i] = rand();
+  
+  FileStandIn fp1(data, size);
+  SocketStandIn sock1(out1);
+  t0 = now_sec();
+  while(fp1.available())
+    sock1.write(fp1.read());
+  t1 = now_sec();
+  report("byte loop", t1 - t0, fp1, sock1);
+  
+  FileStandIn fp2(data, size);
+  SocketStandIn sock2(out2);
+  t0 = now_sec();
+  unsigned long copied = stream_copy(fp2, sock2, buf, sizeof(buf));
+  t1 = now_sec();
+  report("stream_copy", t1 - t0, fp2, sock2);
+  
+  if(copied != size || sock1.len != size || memcmp(out1, data, size) || memcmp(out2, data, size))
+  {
+    printf("MISMATCH\n");
+    return 1;
+  }
+  
+  free(data);
+  free(out1);
+  free(out2);
+  return 0;
+}
@@ -0,0 +1,187 @@
+/*
+ time_bench.cpp - host micro-benchmark for the Time library's calendar code
+ 
+ Compares the year and month loops breakTime() and makeTime() used to have 
+ with the closed form versions now in libraries/Time/Time.cpp, over a 
+ timestamp every 997 seconds from 2010 to 2020, and checks that they agree. 
+ Also times year(t)..second(t) for a clock ticking a second at a time, the 
+ way print_it() uses them, which the incremental cache serves.
+ 
+ Build and run on Linux:
+ 
+   g++ -O2 -Ihost -I../libraries/Time time_bench.cpp ../libraries/Time/Time.cpp -o time_bench
+   ./time_bench
+ 
+ On the ATmega the old loops cost more again: each of the 40 or so years 
+ since 1970 takes a 16 bit modulo or three.
+*/
+
+#include <stdio.h>
+#include <time.h>
+#include "Arduino.h"
+#include "Time.h"
+
+static const time_t start = 1262304000UL; // 1 Jan 2010
+static const time_t end = 1577836800UL;   // 1 Jan 2020
+static const time_t step = 997;
+
+unsigned long millis(void)
+{
+  return 0;
+}
+
+// breakTime() and makeTime() as they were
+#define LEAP_YEAR(Y)     ( ((1970+Y)>0) && !((1970+Y)%4) && ( ((1970+Y)%100) || !((1970+Y)%400) ) )
+
+static const uint8_t monthDays[]={31,28,31,30,31,30,31,31,30,31,30,31};
+
+static void loopBreakTime(time_t time, tmElements_t &tm)
+{
+  uint8_t year;
+  uint8_t month, monthLength;
+  unsigned long days;
+  
+  tm.Second = time % 60;
+  time /= 60;
+  tm.Minute = time % 60;
+  time /= 60;
+  tm.Hour = time % 24;
+  time /= 24;
+  tm.Wday = ((time + 4) % 7) + 1;
+  
+  year = 0;  
+  days = 0;
+  while((unsigned)(days += (LEAP_YEAR(year) ? 366 : 365)) <= time)
+    year++;
+  tm.Year = year;
+  
+  days -= LEAP_YEAR(year) ? 366 : 365;
+  time  -= days;
+  
+  for(month = 0; month < 12; month++)
+  {
+    if(month == 1)
+      monthLength = LEAP_YEAR(year) ? 29 : 28;
+    else
+      monthLength = monthDays[month];
+    
+    if(time >= monthLength)
+      time -= monthLength;
+    else
+      break;
+  }
+  tm.Month = month + 1;
+  tm.Day = time + 1;
+}
+
+static time_t loopMakeTime(tmElements_t &tm)
+{
+  int i;
+  time_t seconds;
+
+  seconds = tm.Year * (SECS_PER_DAY * 365);
+  for(i = 0; i < tm.Year; i++)
+    if(LEAP_YEAR(i))
+      seconds += SECS_PER_DAY;
+  
+  for(i = 1; i < tm.Month; i++)
+  {
+    if((i == 2) && LEAP_YEAR(tm.Year))
+      seconds += SECS_PER_DAY * 29;
+    else
+      seconds += SECS_PER_DAY * monthDays[i-1];
+  }
+  seconds += (tm.Day-1) * SECS_PER_DAY;
+  seconds += tm.Hour * SECS_PER_HOUR;
+  seconds += tm.Minute * SECS_PER_MIN;
+  seconds += tm.Second;
+  return seconds; 
+}
+
+static double now_sec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, double t0, double t1, unsigned long n)
+{
+  printf("%-28s %8.1f ns/call\n", name, (t1 - t0) * 1e9 / n);
+}
+
+int main()
+{
+  tmElements_t a, b;
+  unsigned long n = 0;
+  volatile unsigned long sink = 0;
+  double t0, t1;
+  
+  for(time_t t = start; t < end; t += step)
+  {
+    loopBreakTime(t, a);
+    breakTime(t, b);
+    
+    if(a.Second != b.Second || a.Minute != b.Minute || a.Hour != b.Hour || a.Wday != b.Wday || 
+       a.Day != b.Day || a.Month != b.Month || a.Year != b.Year || makeTime(b) != t || loopMakeTime(a) != t)
+    {
+      printf("MISMATCH at %lu\n", (unsigned long)t);
+      return 1;
+    }
+    n++;
+  }
+  printf("%lu timestamps agree\n", n);
+  
+  t0 = now_sec();
+  for(time_t t = start; t < end; t += step)
+  {
+    loopBreakTime(t, a);
+    sink += a.Day;
+  }
+  t1 = now_sec();
+  report("breakTime, loops", t0, t1, n);
+  
+  t0 = now_sec();
+  for(time_t t = start; t < end; t += step)
+  {
+    breakTime(t, a);
+    sink += a.Day;
+  }
+  t1 = now_sec();
+  report("breakTime, closed form", t0, t1, n);
+  
+  tmElements_t *elements = new tmElements_t[n];
+  for(unsigned long i = 0; i < n; i++)
+    breakTime(start + i * step, elements[i]);
+  
+  t0 = now_sec();
+  for(unsigned long i = 0; i < n; i++)
+    sink += loopMakeTime(elements[i]);
+  t1 = now_sec();
+  report("makeTime, loops", t0, t1, n);
+  
+  t0 = now_sec();
+  for(unsigned long i = 0; i < n; i++)
+    sink += makeTime(elements[i]);
+  t1 = now_sec();
+  report("makeTime, closed form", t0, t1, n);
+  
+  // one record per second, all six fields each
+  t0 = now_sec();
+  for(time_t t = start; t < start + n; t++)
+  {
+    loopBreakTime(t, a);
+    sink += a.Year + a.Month + a.Day + a.Hour + a.Minute + a.Second;
+  }
+  t1 = now_sec();
+  report("fields per tick, no cache", t0, t1, n);
+  
+  t0 = now_sec();
+  for(time_t t = start; t < start + n; t++)
+    sink += year(t) + month(t) + day(t) + hour(t) + minute(t) + second(t);
+  t1 = now_sec();
+  report("fields per tick, cached", t0, t1, n);
+  
+  delete[] elements;
+  return 0;
+}